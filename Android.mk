@@ -17,6 +17,9 @@ LOCAL_SRC_FILES := \
 	src/main.cpp \
 	src/audiomix.cpp \
 	src/fft.cpp \
+	src/sdft.cpp \
+	src/spectrogram.cpp \
+	src/mapfile/mapfile_unix.cpp \
 	src/kissfft/kiss_fft.c \
 	src/kissfft/kiss_fftr.c
 
@@ -0,0 +1,468 @@
+// Decoded audio cache
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+
+#include "audiocache.h"
+#include "mapfile/mapfile.h"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <mutex>
+#include <new>
+#include <type_traits>
+
+namespace ls2x
+{
+namespace audiocache
+{
+
+struct cacheEntry
+{
+	// must be first, the pointer is given to the caller and cast back in close
+	libav::songInformation info;
+	mappedFile *file;
+	// new[], strings point into the mapping
+	libav::songMetadata *metadata;
+};
+// only guaranteed for standard-layout types
+static_assert(std::is_standard_layout<cacheEntry>::value, "cacheEntry must be standard-layout");
+
+struct indexEntry
+{
+	uint64_t size;
+	// higher is more recent
+	uint64_t lastUse;
+};
+
+static std::mutex cacheMutex;
+static std::string cacheDirectory;
+static uint64_t cacheLimit = 0;
+static uint64_t useCounter = 0;
+// file name -> entry, saved as text in the "index" file
+static std::map<std::string, indexEntry> cacheIndex;
+// cache hits only update lastUse in memory, the index is written with the
+// next store, eviction, clear or configure
+static bool indexDirty = false;
+
+static bool statSource(const char *path, uint64_t &size, int64_t &time)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(path, &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return false;
+#endif
+
+	size = uint64_t(st.st_size);
+	time = int64_t(st.st_mtime);
+	return true;
+}
+
+static std::string cacheName(const char *input, uint64_t size, int64_t time)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	auto feed = [&hash](const void *data, size_t length)
+	{
+		for (size_t i = 0; i < length; i++)
+		{
+			hash ^= ((const uint8_t *) data)[i];
+			hash *= 1099511628211ULL;
+		}
+	};
+	feed(input, strlen(input));
+	feed(&size, sizeof(uint64_t));
+	feed(&time, sizeof(int64_t));
+
+	char name[32];
+	sprintf(name, "%016llx.pcm", (unsigned long long) hash);
+	return name;
+}
+
+static void saveIndex()
+{
+	std::string path = cacheDirectory + "index";
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr)
+		return;
+
+	fprintf(f, "LS2A %u\n", unsigned(VERSION));
+	for (auto &x: cacheIndex)
+		fprintf(f, "%s %llu %llu\n", x.first.c_str(), (unsigned long long) x.second.size, (unsigned long long) x.second.lastUse);
+	fclose(f);
+	indexDirty = false;
+}
+
+static void loadIndex()
+{
+	cacheIndex.clear();
+	useCounter = 0;
+	indexDirty = false;
+
+	std::string path = cacheDirectory + "index";
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == nullptr)
+		return;
+
+	unsigned version = 0;
+	if (fscanf(f, "LS2A %u", &version) == 1 && version == VERSION)
+	{
+		char name[64];
+		unsigned long long size, lastUse;
+		while (fscanf(f, "%63s %llu %llu", name, &size, &lastUse) == 3)
+		{
+			// drop entries removed behind our back
+			uint64_t s; int64_t t;
+			if (!statSource((cacheDirectory + name).c_str(), s, t) || s != size)
+				continue;
+
+			cacheIndex[name] = {size, lastUse};
+			if (lastUse > useCounter)
+				useCounter = lastUse;
+		}
+	}
+
+	fclose(f);
+}
+
+static void removeEntry(const std::string &name)
+{
+	// on Windows, files still mapped can't be removed and are left behind
+	remove((cacheDirectory + name).c_str());
+	cacheIndex.erase(name);
+}
+
+// remove least recently used files until below the limit, except keep
+static void evict(const std::string &keep)
+{
+	if (cacheLimit == 0)
+		return;
+
+	uint64_t total = 0;
+	for (auto &x: cacheIndex)
+		total += x.second.size;
+
+	while (total > cacheLimit)
+	{
+		auto oldest = cacheIndex.end();
+		for (auto it = cacheIndex.begin(); it != cacheIndex.end(); ++it)
+		{
+			if (it->first != keep && (oldest == cacheIndex.end() || it->second.lastUse < oldest->second.lastUse))
+				oldest = it;
+		}
+		if (oldest == cacheIndex.end())
+			break;
+
+		total -= oldest->second.size;
+		removeEntry(oldest->first);
+	}
+}
+
+// libav::sampleFormat size, 0 if it's not available in this build
+static uint32_t sampleSize(int format)
+{
+	switch (format)
+	{
+		case libav::SAMPLE_FORMAT_S16:
+			return 2;
+		case libav::SAMPLE_FORMAT_FLOAT:
+			return 4;
+#ifdef LS2X_USE_KISSFFT
+		case libav::SAMPLE_FORMAT_FFT_SCALAR:
+			return uint32_t(sizeof(kiss_fft_scalar));
+#endif
+		default:
+			return 0;
+	}
+}
+
+static bool inRange(uint64_t offset, uint64_t length, uint64_t size)
+{
+	return offset <= size && length <= size - offset;
+}
+
+static cacheEntry *parseEntry(mappedFile *file, const char *input, uint64_t sourceSize, int64_t sourceTime)
+{
+	const char *data = (const char *) file->getData();
+	uint64_t size = file->getSize();
+	size_t pathSize = strlen(input);
+
+	fileHeader header;
+	if (size < sizeof(fileHeader))
+		return nullptr;
+	memcpy(&header, data, sizeof(fileHeader));
+	// the FFT scalar size depends on the build that wrote the file
+	uint64_t frameSize = uint64_t(header.channelCount) * header.bytesPerSample;
+
+	if (
+		memcmp(header.magic, "LS2A", 4) != 0 ||
+		header.version != VERSION ||
+		header.sourceSize != sourceSize ||
+		header.sourceTime != sourceTime ||
+		header.pathSize != pathSize ||
+		!inRange(sizeof(fileHeader), pathSize, size) ||
+		memcmp(data + sizeof(fileHeader), input, pathSize) != 0 ||
+		header.channelCount == 0 ||
+		header.bytesPerSample == 0 ||
+		header.bytesPerSample != sampleSize(header.sampleFormat) ||
+		header.sampleCount > size / frameSize ||
+		!inRange(header.samplesOffset, header.sampleCount * frameSize, size) ||
+		!inRange(header.coverArtOffset, uint64_t(header.coverArtWidth) * header.coverArtHeight * 4, size) ||
+		header.metadataOffset > size
+	)
+		return nullptr;
+
+	cacheEntry *entry = new (std::nothrow) cacheEntry();
+	if (entry == nullptr)
+		return nullptr;
+	if (header.metadataCount > 0)
+	{
+		entry->metadata = new (std::nothrow) libav::songMetadata[header.metadataCount];
+		if (entry->metadata == nullptr)
+		{
+			delete entry;
+			return nullptr;
+		}
+	}
+
+	// strings are NUL-terminated in the file, point straight into it
+	uint64_t offset = header.metadataOffset;
+	for (uint32_t i = 0; i < header.metadataCount; i++)
+	{
+		uint32_t sizes[2];
+		if (!inRange(offset, sizeof(sizes), size))
+		{
+			delete[] entry->metadata;
+			delete entry;
+			return nullptr;
+		}
+		memcpy(sizes, data + offset, sizeof(sizes));
+		offset += sizeof(sizes);
+
+		uint64_t length = uint64_t(sizes[0]) + sizes[1] + 2;
+		if (!inRange(offset, length, size))
+		{
+			delete[] entry->metadata;
+			delete entry;
+			return nullptr;
+		}
+
+		char *key = const_cast<char*>(data + offset);
+		char *value = key + sizes[0] + 1;
+		entry->metadata[i] = {sizes[0], key, sizes[1], value};
+		offset += length;
+	}
+
+	entry->file = file;
+	entry->info.sampleRate = header.sampleRate;
+	entry->info.sampleCount = size_t(header.sampleCount);
+	entry->info.integratedLoudness = header.integratedLoudness;
+	entry->info.loudnessRange = header.loudnessRange;
+	entry->info.truePeak = header.truePeak;
+	entry->info.samples = (short *) (data + header.samplesOffset);
+	entry->info.channelCount = header.channelCount;
+	entry->info.sampleFormat = header.sampleFormat;
+	entry->info.metadataCount = header.metadataCount;
+	entry->info.metadata = entry->metadata;
+	entry->info.coverArtWidth = header.coverArtWidth;
+	entry->info.coverArtHeight = header.coverArtHeight;
+	entry->info.coverArt = header.coverArtWidth > 0 ? const_cast<char*>(data + header.coverArtOffset) : nullptr;
+	return entry;
+}
+
+bool configure(const char *directory, uint64_t sizeLimit)
+{
+	std::lock_guard<std::mutex> lock(cacheMutex);
+
+	// recency of the previous directory
+	if (indexDirty && !cacheDirectory.empty())
+		saveIndex();
+
+	if (directory == nullptr || *directory == 0)
+	{
+		cacheDirectory.clear();
+		cacheIndex.clear();
+		return true;
+	}
+
+	struct stat st;
+	if (stat(directory, &st) != 0 || (st.st_mode & S_IFDIR) == 0)
+		return false;
+
+	cacheDirectory = directory;
+	if (cacheDirectory.back() != '/' && cacheDirectory.back() != '\\')
+		cacheDirectory += '/';
+	cacheLimit = sizeLimit;
+
+	loadIndex();
+	evict(std::string());
+	saveIndex();
+	return true;
+}
+
+libav::songInformation *open(const char *input)
+{
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!statSource(input, sourceSize, sourceTime))
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	if (cacheDirectory.empty())
+		return nullptr;
+
+	std::string name = cacheName(input, sourceSize, sourceTime);
+	auto it = cacheIndex.find(name);
+	if (it == cacheIndex.end())
+		return nullptr;
+
+	mappedFile *file = mappedFile::newMappedFile((cacheDirectory + name).c_str());
+	cacheEntry *entry = file ? parseEntry(file, input, sourceSize, sourceTime) : nullptr;
+	if (entry == nullptr)
+	{
+		// stale, hash collision, or corrupt
+		delete file;
+		removeEntry(name);
+		saveIndex();
+		return nullptr;
+	}
+
+	it->second.lastUse = ++useCounter;
+	indexDirty = true;
+	return &entry->info;
+}
+
+void close(libav::songInformation *info)
+{
+	cacheEntry *entry = (cacheEntry *) info;
+	delete entry->file;
+	delete[] entry->metadata;
+	delete entry;
+}
+
+bool store(const char *input, const libav::songInformation *info)
+{
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!statSource(input, sourceSize, sourceTime))
+		return false;
+
+	uint32_t bytesPerSample = sampleSize(info->sampleFormat);
+	if (bytesPerSample == 0 || info->channelCount == 0 || info->channelCount > 0xFFFF)
+		return false;
+	uint64_t frameSize = uint64_t(info->channelCount) * bytesPerSample;
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	if (cacheDirectory.empty())
+		return false;
+
+	fileHeader header = {};
+	memcpy(header.magic, "LS2A", 4);
+	header.version = VERSION;
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	header.pathSize = uint32_t(strlen(input));
+	header.sampleRate = uint32_t(info->sampleRate);
+	header.sampleCount = info->sampleCount;
+	header.integratedLoudness = info->integratedLoudness;
+	header.loudnessRange = info->loudnessRange;
+	header.truePeak = info->truePeak;
+	header.metadataCount = uint32_t(info->metadataCount);
+	header.coverArtWidth = info->coverArt ? uint32_t(info->coverArtWidth) : 0;
+	header.coverArtHeight = info->coverArt ? uint32_t(info->coverArtHeight) : 0;
+	header.channelCount = uint16_t(info->channelCount);
+	header.sampleFormat = uint8_t(info->sampleFormat);
+	header.bytesPerSample = uint8_t(bytesPerSample);
+
+	// samples are 16-byte aligned for SIMD readers
+	uint64_t metadataSize = 0;
+	for (size_t i = 0; i < info->metadataCount; i++)
+		metadataSize += sizeof(uint32_t) * 2 + info->metadata[i].keySize + info->metadata[i].valueSize + 2;
+	header.samplesOffset = (sizeof(fileHeader) + header.pathSize + 15) & ~uint64_t(15);
+	header.metadataOffset = header.samplesOffset + header.sampleCount * frameSize;
+	header.coverArtOffset = header.metadataOffset + metadataSize;
+	uint64_t total = header.coverArtOffset + uint64_t(header.coverArtWidth) * header.coverArtHeight * 4;
+
+	if (cacheLimit > 0 && total > cacheLimit)
+		return false;
+
+	std::string name = cacheName(input, sourceSize, sourceTime);
+	std::string path = cacheDirectory + name;
+	std::string temp = path + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (f == nullptr)
+		return false;
+
+	static const char padding[16] = {0};
+	size_t paddingSize = size_t(header.samplesOffset - sizeof(fileHeader) - header.pathSize);
+	bool ok = fwrite(&header, sizeof(fileHeader), 1, f) == 1 &&
+		fwrite(input, 1, header.pathSize, f) == header.pathSize &&
+		fwrite(padding, 1, paddingSize, f) == paddingSize &&
+		fwrite(info->samples, size_t(frameSize), info->sampleCount, f) == info->sampleCount;
+
+	for (size_t i = 0; ok && i < info->metadataCount; i++)
+	{
+		const libav::songMetadata &m = info->metadata[i];
+		uint32_t sizes[2] = {uint32_t(m.keySize), uint32_t(m.valueSize)};
+		ok = fwrite(sizes, sizeof(sizes), 1, f) == 1 &&
+			fwrite(m.key, 1, m.keySize + 1, f) == m.keySize + 1 &&
+			fwrite(m.value, 1, m.valueSize + 1, f) == m.valueSize + 1;
+	}
+
+	if (ok && header.coverArtWidth > 0)
+	{
+		size_t coverSize = size_t(header.coverArtWidth) * header.coverArtHeight * 4;
+		ok = fwrite(info->coverArt, 1, coverSize, f) == coverSize;
+	}
+
+	ok = fclose(f) == 0 && ok;
+	// rename won't replace existing file on Windows
+	remove(path.c_str());
+	if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+	{
+		remove(temp.c_str());
+		cacheIndex.erase(name);
+		saveIndex();
+		return false;
+	}
+
+	cacheIndex[name] = {total, ++useCounter};
+	evict(name);
+	saveIndex();
+	return true;
+}
+
+void clear()
+{
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	if (cacheDirectory.empty())
+		return;
+
+	while (!cacheIndex.empty())
+		removeEntry(cacheIndex.begin()->first);
+	saveIndex();
+}
+
+const std::map<std::string, void*> &getFunctions()
+{
+	static std::map<std::string, void*> funcs = {
+		{"audioCacheConfigure", (void*) configure},
+		{"audioCacheOpen", (void*) open},
+		{"audioCacheClose", (void*) close},
+		{"audioCacheStore", (void*) store},
+		{"audioCacheClear", (void*) clear},
+	};
+	return funcs;
+}
+
+}
+}
+#endif
@@ -0,0 +1,65 @@
+// Decoded audio cache
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+#ifndef _LS2X_AUDIOCACHE_
+#define _LS2X_AUDIOCACHE_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "libav.h"
+
+namespace ls2x
+{
+namespace audiocache
+{
+
+// File layout, in native byte order since the cache is machine-local:
+// fileHeader, source path (pathSize bytes), then at samplesOffset
+// sampleCount frames of channelCount samples of sampleFormat (bytesPerSample
+// each), at metadataOffset metadataCount of
+// (uint32_t keySize, uint32_t valueSize, key, NUL, value, NUL) and at
+// coverArtOffset the RGBA cover art, if any.
+// Files are named after a hash of source path, size and modification time.
+const uint32_t VERSION = 3;
+
+struct fileHeader
+{
+	char magic[4]; // "LS2A"
+	uint32_t version;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint32_t pathSize;
+	uint32_t sampleRate;
+	uint64_t sampleCount;
+	uint32_t metadataCount;
+	uint32_t coverArtWidth, coverArtHeight;
+	uint16_t channelCount;
+	uint8_t sampleFormat;
+	uint8_t bytesPerSample;
+	uint64_t samplesOffset, metadataOffset, coverArtOffset;
+	double integratedLoudness, loudnessRange, truePeak;
+};
+
+// directory must exist, null disables the cache
+// sizeLimit is in bytes, least recently used files are removed above it
+bool configure(const char *directory, uint64_t sizeLimit);
+// memory mapped song for input, or null if not cached (or stale)
+// pointers are read-only and valid until close, don't av_free them
+libav::songInformation *open(const char *input);
+void close(libav::songInformation *info);
+// write decoded song of input to the cache
+bool store(const char *input, const libav::songInformation *info);
+// remove all cached files
+void clear();
+
+const std::map<std::string, void*> &getFunctions();
+
+}
+}
+
+#endif
+#endif
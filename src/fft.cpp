@@ -24,6 +24,18 @@ namespace ls2x
 namespace fft
 {
 
+// squared magnitude of one bin
+static inline kiss_fft_scalar_t power(const kiss_fft_cpx &c)
+{
+	return c.r * c.r + c.i * c.i;
+}
+
+// kiss_fftr only computes bin 0 to n/2, the rest is mirrored
+static inline const kiss_fft_cpx &realBin(const kiss_fft_cpx *bins, size_t i, size_t sampleSize)
+{
+	return bins[i <= sampleSize / 2 ? i : sampleSize - i];
+}
+
 kiss_fft_cfg getCfg(size_t sampleSize)
 {
 	static kiss_fft_cfg cfg = nullptr;
@@ -55,7 +67,7 @@ kiss_fftr_cfg getCfg(size_t sampleSize, std::nullptr_t v)
 void fftr(const short *input, kiss_fft_scalar_t *out_l, kiss_fft_scalar_t *out_r, size_t sampleSize)
 {
 	kiss_fft_cfg kcfg = getCfg(sampleSize);
-	// input: left at 0, right at 1
+	// input: left at 0, right at 1 (planar)
 	// output: left is 2, right is 3
 	kiss_fft_cpx *ptrdata = new kiss_fft_cpx[sampleSize * 4];
 	memset(ptrdata + sampleSize * 2, 0, sampleSize * 2 * sizeof(kiss_fft_cpx));
@@ -63,8 +75,8 @@ void fftr(const short *input, kiss_fft_scalar_t *out_l, kiss_fft_scalar_t *out_r
 	PARALLELIZE_LOOP
 	for (int i = 0; i < sampleSize; i++)
 	{
-		ptrdata[i * 2 + 0] = {kiss_fft_scalar_t(input[i * 2]) / kiss_fft_scalar_t(32767), 0};
-		ptrdata[i * 2 + 1] = {kiss_fft_scalar_t(input[i * 2 + 1]) / kiss_fft_scalar_t(32767), 0};
+		ptrdata[i] = {kiss_fft_scalar_t(input[i * 2]) / kiss_fft_scalar_t(32767), 0};
+		ptrdata[i + sampleSize] = {kiss_fft_scalar_t(input[i * 2 + 1]) / kiss_fft_scalar_t(32767), 0};
 	}
 
 	kiss_fft(kcfg, ptrdata, ptrdata + sampleSize * 2);
@@ -75,8 +87,8 @@ void fftr(const short *input, kiss_fft_scalar_t *out_l, kiss_fft_scalar_t *out_r
 	{
 		kiss_fft_cpx &l = (ptrdata + sampleSize * 2)[i];
 		kiss_fft_cpx &r = (ptrdata + sampleSize * 3)[i];
-		out_l[i] = abs(l.i * l.i + l.r + l.r);
-		out_r[i] = abs(r.i * r.i + r.r * r.r);
+		out_l[i] = power(l);
+		out_r[i] = power(r);
 	}
 
 	delete[] ptrdata;
@@ -96,8 +108,8 @@ void fftr(const short *input, kiss_fft_scalar_t *out, size_t sampleSize, bool st
 		PARALLELIZE_LOOP
 		for (int i = 0; i < sampleSize; i++)
 		{
-			ptrdata[i * 2 + 0] = {kiss_fft_scalar_t(input[i * 2]) / kiss_fft_scalar_t(32767), 0};
-			ptrdata[i * 2 + 1] = {kiss_fft_scalar_t(input[i * 2 + 1]) / kiss_fft_scalar_t(32767), 0};
+			ptrdata[i] = {kiss_fft_scalar_t(input[i * 2]) / kiss_fft_scalar_t(32767), 0};
+			ptrdata[i + sampleSize] = {kiss_fft_scalar_t(input[i * 2 + 1]) / kiss_fft_scalar_t(32767), 0};
 		}
 
 		kiss_fft(kcfg, ptrdata, ptrdata + sampleSize * 2);
@@ -108,7 +120,7 @@ void fftr(const short *input, kiss_fft_scalar_t *out, size_t sampleSize, bool st
 		{
 			kiss_fft_cpx &l = (ptrdata + sampleSize * 2)[i];
 			kiss_fft_cpx &r = (ptrdata + sampleSize * 3)[i];
-			out[i] = (abs(l.i * l.i + l.r + l.r) + abs(r.i * r.i + r.r * r.r)) * kiss_fft_scalar_t(0.5);
+			out[i] = (power(l) + power(r)) * kiss_fft_scalar_t(0.5);
 		}
 
 		delete[] ptrdata;
@@ -128,7 +140,7 @@ void fftr(const short *input, kiss_fft_scalar_t *out, size_t sampleSize, bool st
 		for (int i = 0; i < sampleSize; i++)
 		{
 			kiss_fft_cpx &l = (ptrdata + sampleSize)[i];
-			out[i] = abs(l.i * l.i + l.r + l.r);
+			out[i] = power(l);
 		}
 
 		delete[] ptrdata;
@@ -146,10 +158,8 @@ void fftr(const kiss_fft_scalar_t *in, kiss_fft_scalar_t *out_l, kiss_fft_scalar
 	PARALLELIZE_LOOP
 	for (int i = 0; i < sampleSize; i++)
 	{
-		kiss_fft_cpx &l = ptrdata[i];
-		kiss_fft_cpx &r = ptrdata[i];
-		out_l[i] = abs(l.i * l.i + l.r + l.r);
-		out_r[i] = abs(r.i * r.i + r.r + r.r);
+		out_l[i] = power(realBin(ptrdata, i, sampleSize));
+		out_r[i] = power(realBin(ptrdata + sampleSize, i, sampleSize));
 	}
 
 	delete[] ptrdata;
@@ -180,9 +190,7 @@ void fftr(const kiss_fft_scalar_t *in, kiss_fft_scalar_t *out, size_t sampleSize
 		PARALLELIZE_LOOP
 		for (int i = 0; i < sampleSize; i++)
 		{
-			kiss_fft_cpx &l = ptrdata[i];
-			kiss_fft_cpx &r = ptrdata[i + sampleSize];
-			out[i] = (abs(l.i * l.i + l.r + l.r) + abs(r.i * r.i + r.r * r.r)) * kiss_fft_scalar_t(0.5);
+			out[i] = (power(realBin(ptrdata, i, sampleSize)) + power(realBin(ptrdata + sampleSize, i, sampleSize))) * kiss_fft_scalar_t(0.5);
 		}
 
 		delete[] inbuf;
@@ -196,8 +204,7 @@ void fftr(const kiss_fft_scalar_t *in, kiss_fft_scalar_t *out, size_t sampleSize
 		PARALLELIZE_LOOP
 		for (int i = 0; i < sampleSize; i++)
 		{
-			kiss_fft_cpx &l = ptrdata[i];
-			out[i] = abs(l.i * l.i + l.r + l.r);
+			out[i] = power(realBin(ptrdata, i, sampleSize));
 		}
 	}
 
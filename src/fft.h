@@ -25,13 +25,16 @@ namespace fft
 
 typedef kiss_fft_scalar kiss_fft_scalar_t;
 
-// stereo input > stereo separated fftr
+// All variants write sampleSize squared magnitudes per output.
+// Scalar (kiss_fft_scalar) variants need even sampleSize.
+
+// interleaved stereo input > stereo separated fftr
 void fftr(const short *input, kiss_fft_scalar_t *out_l, kiss_fft_scalar_t *out_r, size_t sampleSize);
-// stereo input > mono merged fftr (or mono input > mono fftr)
+// interleaved stereo input > mono merged fftr (or mono input > mono fftr)
 void fftr(const short *input, kiss_fft_scalar_t *out, size_t sampleSize, bool stereo);
-// stereo input -> stereo separated fftr
+// planar stereo input (left then right) -> stereo separated fftr
 void fftr(const kiss_fft_scalar_t *in, kiss_fft_scalar_t *out_l, kiss_fft_scalar_t *out_r, size_t sampleSize);
-// stereo input > mono merged fftr (or mono input > mono fftr)
+// interleaved stereo input > mono merged fftr (or mono input > mono fftr)
 void fftr(const kiss_fft_scalar_t *in, kiss_fft_scalar_t *out, size_t sampleSize, bool stereo);
 // very ugly
 const char *scalarType();
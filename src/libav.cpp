@@ -5,7 +5,17 @@
 #ifdef LS2X_USE_LIBAV
 #include "libav.h"
 
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 namespace ls2x
 {
@@ -16,6 +26,9 @@ libavFunctions avF;
 bool encodingSupported = false;
 bool libavSatisfied = false;
 const char *usedEncoder = nullptr;
+// 0 = auto, 1 = off (default). Read by worker and job threads
+std::atomic<int> decoderThreadCount(1);
+std::atomic<int> decoderThreadType(FF_THREAD_FRAME | FF_THREAD_SLICE);
 
 ls2x::so *loadLibAVDLL(const char *name, int version)
 {
@@ -114,22 +127,41 @@ static void fixChannelLayout(AV *ctx)
 #endif
 }
 
-static bool initializeSwresample(SwrContext **swr, AVCodecContext *ctx)
+bool setDecoderThreading(int threadCount, int threadType)
+{
+	if (threadCount < 0 || (threadType & ~(FF_THREAD_FRAME | FF_THREAD_SLICE)) || threadType == 0)
+		return false;
+
+	decoderThreadCount = threadCount;
+	decoderThreadType = threadType;
+	return true;
+}
+
+// must be called before avcodec_open2
+void applyDecoderThreading(AVCodecContext *ctx)
+{
+	ctx->thread_count = decoderThreadCount;
+	ctx->thread_type = decoderThreadType;
+}
+
+// output rate 0 keeps the decoder sample rate
+static bool initializeSwresample(SwrContext **swr, AVCodecContext *ctx, int outRate = 0, int outChannels = 2, AVSampleFormat outFormat = AV_SAMPLE_FMT_S16)
 {
 	fixChannelLayout(ctx);
+	if (outRate <= 0)
+		outRate = ctx->sample_rate;
 
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 0)
 	// FFmpeg 6
 #	if LIBSWRESAMPLE_VERSION_INT >= AV_VERSION_INT(4, 10, 0)
-	// use swr_alloc_set_opts2
-	static AVChannelLayout stereo = {AV_CHANNEL_ORDER_UNSPEC};
-	if (stereo.order == AV_CHANNEL_ORDER_UNSPEC)
-		avF.channelLayoutFromMask(&stereo, AV_CH_LAYOUT_STEREO);
+	// use swr_alloc_set_opts2, native order layouts need no uninit
+	AVChannelLayout outLayout;
+	avF.getDefaultChannelLayout(&outLayout, outChannels);
 
 	return avF.swrAllocSetOpts(swr,
-		&stereo,
-		AV_SAMPLE_FMT_S16,
-		ctx->sample_rate,
+		&outLayout,
+		outFormat,
+		outRate,
 		&ctx->ch_layout,
 		ctx->sample_fmt,
 		ctx->sample_rate,
@@ -141,9 +173,9 @@ static bool initializeSwresample(SwrContext **swr, AVCodecContext *ctx)
 #else // LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 100)
 	// use swr_alloc_set_opts
 	SwrContext *newSwr = avF.swrAllocSetOpts(*swr,
-		AV_CH_LAYOUT_STEREO,
-		AV_SAMPLE_FMT_S16,
-		ctx->sample_rate,
+		avF.getDefaultChannelLayout(outChannels),
+		outFormat,
+		outRate,
 		ctx->channel_layout,
 		ctx->sample_fmt,
 		ctx->sample_rate,
@@ -155,19 +187,6 @@ static bool initializeSwresample(SwrContext **swr, AVCodecContext *ctx)
 #endif // LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 100)
 }
 
-static void setFrameChannelLayout(AVFrame *frame, uint64_t mask)
-{
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 0)
-#	if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(58, 2, 0)
-	avF.channelLayoutFromMask(&frame->ch_layout, mask);
-# 	else
-#		error "Using libavcodec 60 requires libavutil 58.2"
-#	endif
-#else
-	frame->channel_layout = mask;
-#endif
-}
-
 // isSupported also initialize the libav
 bool isSupported()
 {
@@ -238,558 +257,2358 @@ bool isSupported()
 	return true;
 }
 
-AVFormatContext *g_FormatContext = nullptr;
-AVCodecContext *g_VCodecContext = nullptr;
-AVFrame *g_VFrame = nullptr;
-SwsContext *g_SwsContext = nullptr;
-AVPacket *g_Packet = nullptr;
-
-int g_Width = 0, g_Height = 0, g_Framerate = 0;
-size_t g_FrameCounter = 0;
+// in order of preference, matroska takes all of them
+static const char *audioEncoders[] = {"flac", "aac", "pcm_s16le"};
 
-void clean()
+struct encoderSlot
 {
-	avF.swsFreeContext(g_SwsContext); g_SwsContext = nullptr;
-	if (g_Packet)
-		avF.packetFree(&g_Packet);
-	if (g_VFrame)
-		avF.frameFree(&g_VFrame);
-	if (g_VCodecContext)
-		avF.codecFreeContext(&g_VCodecContext);
-	if (g_FormatContext)
-	{
-		if (g_FormatContext->pb)
-			avF.ioClose(&g_FormatContext->pb);
-		avF.formatFreeContext(g_FormatContext);
-		g_FormatContext = nullptr;
-	}
-}
-
-bool startSession(const char *output, int width, int height, int framerate)
+	// RGBA copy of the supplied frame, rows are stride bytes apart and
+	// bottom-up if flip is set
+	uint8_t *data;
+	AVFrame *frame;
+	// ENCODER_TIMING_CFR: times the previous frame is repeated before this one
+	int64_t duplicates;
+	size_t capacity;
+	int stride;
+	bool flip;
+};
+
+// Everything of one recording. supply only copies the frame into a free
+// slot, the conversion thread turns it into the codec pixel format and the
+// encoding thread encodes and muxes it
+struct encoderSession
 {
-	if (!encodingSupported) return false;
-
-	// open output context
-	if (avF.formatAllocOutputContext(&g_FormatContext, nullptr, nullptr, output) < 0)
+	AVFormatContext *formatContext;
+	AVCodecContext *vCodecContext;
+	AVPacket *packet;
+	int width, height, framerate;
+
+	// optional audio track, stereo S16 input collected into encoder frames
+	AVCodecContext *aCodecContext;
+	AVFrame *aFrame;
+	SwrContext *audioSwr;
+	AVPacket *aPacket;
+	std::vector<short> audioPending;
+	size_t audioFrameSize;
+	int64_t audioSamples;
+	// supplyAudio may run on the audio thread
+	std::mutex audioMutex;
+	// both encoders write to the muxer
+	std::mutex muxMutex;
+
+	std::vector<encoderSlot> slots;
+	// slot queues, null in encoding means the conversion thread is done
+	std::deque<encoderSlot*> idle, converting, encoding;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread converter, encoder;
+	bool dropFrames, closing, failed;
+	size_t dropped, duplicated;
+	// encoderTiming, first frame time and where the next frame may go
+	int timing;
+	double startTime;
+	int64_t nextPts;
+
+	// color conversion in horizontal bands, band i covers rows sliceRows[i]
+	// to sliceRows[i + 1] with its own sws context. The conversion thread
+	// does band 0 and waits for the slice threads to do the rest
+	std::vector<SwsContext*> sliceContexts;
+	std::vector<int> sliceRows;
+	int chromaShift;
+	std::vector<std::thread> sliceThreads;
+	std::mutex sliceMutex;
+	std::condition_variable sliceStart, sliceDone;
+	encoderSlot *sliceSlot;
+	uint64_t sliceGeneration;
+	size_t slicesPending;
+	bool sliceStop;
+
+	// getEncoderStats, stages are timed on different threads
+	std::mutex statsMutex;
+	encoderStageStats stages[ENCODER_STAGE_COUNT];
+	uint64_t encodedFrames, encodedBytes;
+	// end of the last muxed packet, in seconds
+	double muxedTime;
+};
+
+// for the startSession API
+encoderSession *g_Session = nullptr;
+size_t encoderQueueSize = 4;
+int encoderBackpressure = ENCODER_BLOCK;
+
+bool setEncoderPipeline(size_t queueSize, int backpressure)
+{
+	if (queueSize == 0 || (backpressure != ENCODER_BLOCK && backpressure != ENCODER_DROP))
 		return false;
-	// open file
-	if ((g_FormatContext->oformat->flags & AVFMT_NOFILE) == 0)
-		if (avF.ioOpen(&g_FormatContext->pb, output, AVIO_FLAG_WRITE) < 0)
-		{
-			clean();
-			return false;
-		}
 
-	// new video stream
-	const AVCodec *vCodec = avF.codecFindEncoderByName(usedEncoder);
-	AVStream *vStream = avF.formatNewStream(g_FormatContext, vCodec);
-	vStream->id = g_FormatContext->nb_streams - 1;
-	vStream->time_base = {1, framerate};
-	vStream->avg_frame_rate = {framerate, 1};
-	vStream->codecpar->width = width;
-	vStream->codecpar->height = height;
+	encoderQueueSize = queueSize;
+	encoderBackpressure = backpressure;
+	return true;
+}
 
-	// new codec context
-	g_VCodecContext = avF.codecAllocContext(vCodec);
-	if (g_VCodecContext == nullptr)
-	{
-		clean();
-		return false;
-	}
+static double clockTime()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	// Set codec context values
-	g_VCodecContext->width = width;
-	g_VCodecContext->height = height;
-	g_VCodecContext->time_base = {1, framerate};
-	g_VCodecContext->framerate = {framerate, 1};
-	g_VCodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
+static void recordStage(encoderSession *s, int stage, double time)
+{
+	size_t bucket = 0;
+	for (double limit = 0.000125; time >= limit && bucket < ENCODER_HISTOGRAM_SIZE - 1; limit *= 2)
+		bucket++;
+
+	std::lock_guard<std::mutex> lock(s->statsMutex);
+	encoderStageStats &stats = s->stages[stage];
+	stats.count++;
+	stats.totalTime += time;
+	stats.maxTime = std::max(stats.maxTime, time);
+	stats.histogram[bucket]++;
+}
 
-	// x264-specific: use qp=0 and preset=slow
-	if (strstr(usedEncoder, "libx264"))
-	{
-		avF.optSet(g_VCodecContext->priv_data, "crf", "0", 0);
-		avF.optSet(g_VCodecContext->priv_data, "preset", "slow", 0);
-		
-		if (strcmp(usedEncoder, "libx264rgb") == 0)
-			g_VCodecContext->pix_fmt = AV_PIX_FMT_BGR0;
-		else if (strcmp(usedEncoder, "libx264") == 0)
-			g_VCodecContext->pix_fmt = AV_PIX_FMT_YUV444P;
-	}
-	// libvpx-vp9-specific: use lossless=1
-	else if (strcmp(usedEncoder, "libvpx-vp9") == 0)
+static void stopSliceThreads(encoderSession *s)
+{
 	{
-		g_VCodecContext->pix_fmt = AV_PIX_FMT_GBRP;
-		avF.optSet(g_VCodecContext->priv_data, "lossless", "1", 0);
+		std::lock_guard<std::mutex> lock(s->sliceMutex);
+		s->sliceStop = true;
+		s->sliceStart.notify_all();
 	}
-	// png: pixel format = rgb24
-	else if (strcmp(usedEncoder, "png") == 0)
-		g_VCodecContext->pix_fmt = AV_PIX_FMT_RGB24;
-
-	if (g_FormatContext->oformat->flags & AVFMT_GLOBALHEADER)
-		g_VCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-	// Open codec
-	if (avF.codecOpen(g_VCodecContext, vCodec, nullptr) < 0)
-	{
-		clean();
-		return false;
-	}
+	for (std::thread &t: s->sliceThreads)
+		t.join();
+	s->sliceThreads.clear();
+}
 
-	avF.codecParametersFromContext(vStream->codecpar, g_VCodecContext);
+// conversion and encoding threads must not be running
+static void freeEncoderSession(encoderSession *s)
+{
+	stopSliceThreads(s);
+	for (SwsContext *sws: s->sliceContexts)
+		avF.swsFreeContext(sws);
 
-	// new video frame
-	g_VFrame = avF.frameAlloc();
-	g_VFrame->format = g_VCodecContext->pix_fmt;
-	g_VFrame->width = width;
-	g_VFrame->height = height;
-	if (avF.frameGetBuffer(g_VFrame, 32) < 0)
-	{
-		clean();
-		return false;
-	}
-	g_SwsContext = avF.swsGetContext(
-		width, height, AV_PIX_FMT_RGBA, // src (supplier)
-		width, height, g_VCodecContext->pix_fmt, // dest (encode)
-		SWS_BILINEAR, // flags
-		nullptr, nullptr, nullptr // other
-	);
-	if (g_SwsContext == nullptr)
+	for (encoderSlot &slot: s->slots)
 	{
-		clean();
-		return false;
+		avF.free(slot.data);
+		if (slot.frame)
+			avF.frameFree(&slot.frame);
 	}
 
-	// new packet
-	g_Packet = avF.packetAlloc();
-	if (g_Packet == nullptr) return false;
-
-	// write header
-	int ret = avF.formatWriteHeader(g_FormatContext, nullptr);
-	if (ret < 0)
+	if (s->audioSwr)
+		avF.swrFree(&s->audioSwr);
+	if (s->aPacket)
+		avF.packetFree(&s->aPacket);
+	if (s->aFrame)
+		avF.frameFree(&s->aFrame);
+	if (s->aCodecContext)
+		avF.codecFreeContext(&s->aCodecContext);
+	if (s->packet)
+		avF.packetFree(&s->packet);
+	if (s->vCodecContext)
+		avF.codecFreeContext(&s->vCodecContext);
+	if (s->formatContext)
 	{
-		printAVError(ret);
-		clean();
-		return false;
+		if (s->formatContext->pb)
+			avF.ioClose(&s->formatContext->pb);
+		avF.formatFreeContext(s->formatContext);
 	}
-	// debug
-	avF.dumpFormat(g_FormatContext, 0, output, true);
-	g_Width = width; g_Height = height; g_Framerate = framerate;
-	g_FrameCounter = 0;
-	return true;
+
+	delete s;
 }
 
-bool supply(const void *videoData)
+// send frame (null flushes) and mux everything the encoder gives back
+static bool encodePackets(encoderSession *s, AVCodecContext *ctx, AVFrame *frame, AVPacket *packet, AVStream *stream)
 {
-	// video scaling
-	if (avF.frameMakeWritable(g_VFrame) < 0)
-		return false;
-	const uint8_t *vData[] = {(const uint8_t*)videoData};
-	int vLinesize[] = {g_Width * 4};
-	avF.swsScale(g_SwsContext, vData, vLinesize, 0, g_Height, g_VFrame->data, g_VFrame->linesize);
-#if LIBAVCODEC_VERSION_MAJOR >= 60
-	g_VFrame->pts = g_VCodecContext->frame_num;
-#else
-	g_VFrame->pts = g_VCodecContext->frame_number;
-#endif
-
-	// Video encode
-	int ret = avF.codecSendFrame(g_VCodecContext, g_VFrame);
+	// time spent in the encoder, muxing is recorded separately
+	double encodeTime = 0, start = clockTime();
+	int ret = avF.codecSendFrame(ctx, frame);
 	if (ret < 0)
 		return false;
 	while (ret >= 0)
 	{
-		ret = avF.codecReceivePacket(g_VCodecContext, g_Packet);
+		ret = avF.codecReceivePacket(ctx, packet);
+		double now = clockTime();
+		encodeTime += now - start;
 		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
 			break;
 		else if (ret < 0)
 			return false;
 
-		avF.packetRescaleTS(g_Packet, g_VCodecContext->time_base, g_FormatContext->streams[0]->time_base);
-		if (avF.interleavedWriteFrame(g_FormatContext, g_Packet) < 0)
+		avF.packetRescaleTS(packet, ctx->time_base, stream->time_base);
+		packet->stream_index = stream->index;
+		int size = packet->size;
+		double end = double(packet->pts + packet->duration) * av_q2d(stream->time_base);
+		{
+			std::lock_guard<std::mutex> lock(s->muxMutex);
+			ret = avF.interleavedWriteFrame(s->formatContext, packet);
+		}
+		avF.packetUnref(packet);
+		start = clockTime();
+		recordStage(s, ENCODER_STAGE_MUX, start - now);
+		if (ret < 0)
 			return false;
 
-		avF.packetUnref(g_Packet);
+		std::lock_guard<std::mutex> lock(s->statsMutex);
+		s->encodedBytes += uint64_t(size);
+		s->muxedTime = std::max(s->muxedTime, end);
 	}
 
+	if (ctx == s->vCodecContext && frame)
+		recordStage(s, ENCODER_STAGE_ENCODE, encodeTime);
 	return true;
 }
 
-void endSession()
+static bool encodeFrame(encoderSession *s, AVFrame *frame)
 {
-	if (g_FormatContext == nullptr) return;
-
-	// Flush
-	int ret = avF.codecSendFrame(g_VCodecContext, nullptr);
-	while (ret >= 0)
+	if (frame)
 	{
-		ret = avF.codecReceivePacket(g_VCodecContext, g_Packet);
-		if (ret >= 0)
-		{
-			avF.packetRescaleTS(g_Packet, g_VCodecContext->time_base, g_FormatContext->streams[0]->time_base);
-			avF.interleavedWriteFrame(g_FormatContext, g_Packet);
-		}
-		avF.packetUnref(g_Packet);
+		std::lock_guard<std::mutex> lock(s->statsMutex);
+		s->encodedFrames++;
 	}
 
-	// write trailer
-	avF.interleavedWriteFrame(g_FormatContext, nullptr);
-	avF.writeTrailer(g_FormatContext);
-	clean();
+	return encodePackets(s, s->vCodecContext, frame, s->packet, s->formatContext->streams[0]);
+}
+
+// from stereo S16 to what the audio encoder takes
+static bool initializeEncoderSwresample(SwrContext **swr, AVCodecContext *ctx)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 0)
+	AVChannelLayout inLayout;
+	avF.getDefaultChannelLayout(&inLayout, 2);
+
+	return avF.swrAllocSetOpts(swr,
+		&ctx->ch_layout,
+		ctx->sample_fmt,
+		ctx->sample_rate,
+		&inLayout,
+		AV_SAMPLE_FMT_S16,
+		ctx->sample_rate,
+		0, nullptr
+	) == 0;
+#else
+	SwrContext *newSwr = avF.swrAllocSetOpts(*swr,
+		ctx->channel_layout,
+		ctx->sample_fmt,
+		ctx->sample_rate,
+		avF.getDefaultChannelLayout(2),
+		AV_SAMPLE_FMT_S16,
+		ctx->sample_rate,
+		0, nullptr
+	);
+	if (newSwr != nullptr)
+		*swr = newSwr;
+	return newSwr != nullptr;
+#endif
 }
 
-void deleteQueue(std::queue<AVFrame*> *&queue)
+// new audio stream, must be called before writing the header
+static bool openAudioEncoder(encoderSession *s, int sampleRate)
 {
-	size_t s = queue->size();
-	while (s-- > 0)
+	const AVCodec *aCodec = nullptr;
+	for (const char *name: audioEncoders)
 	{
-		AVFrame *temp = queue->front();
-		avF.frameFree(&temp);
-		queue->pop();
+		if ((aCodec = avF.codecFindEncoderByName(name)) != nullptr)
+			break;
 	}
-	delete queue; queue = nullptr;
+	if (aCodec == nullptr)
+		return false;
+
+	AVStream *aStream = avF.formatNewStream(s->formatContext, aCodec);
+	s->aCodecContext = avF.codecAllocContext(aCodec);
+	if (aStream == nullptr || s->aCodecContext == nullptr)
+		return false;
+	aStream->id = s->formatContext->nb_streams - 1;
+	aStream->time_base = {1, sampleRate};
+
+	AVCodecContext *ctx = s->aCodecContext;
+	ctx->sample_rate = sampleRate;
+	ctx->time_base = {1, sampleRate};
+	ctx->sample_fmt = aCodec->sample_fmts ? aCodec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 0)
+	avF.getDefaultChannelLayout(&ctx->ch_layout, 2);
+#else
+	ctx->channels = 2;
+	ctx->channel_layout = (uint64_t) avF.getDefaultChannelLayout(2);
+#endif
+	if (s->formatContext->oformat->flags & AVFMT_GLOBALHEADER)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if (avF.codecOpen(ctx, aCodec, nullptr) < 0)
+		return false;
+	avF.codecParametersFromContext(aStream->codecpar, ctx);
+
+	// frame of the size the encoder wants, any size is fine for some
+	s->aFrame = avF.frameAlloc();
+	if (s->aFrame == nullptr)
+		return false;
+	s->aFrame->format = ctx->sample_fmt;
+	s->aFrame->sample_rate = sampleRate;
+	s->audioFrameSize = ctx->frame_size > 0 && (aCodec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) == 0
+		? size_t(ctx->frame_size)
+		: 1024;
+	s->aFrame->nb_samples = int(s->audioFrameSize);
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(60, 0, 0)
+	avF.getDefaultChannelLayout(&s->aFrame->ch_layout, 2);
+#else
+	s->aFrame->channels = 2;
+	s->aFrame->channel_layout = ctx->channel_layout;
+#endif
+	if (avF.frameGetBuffer(s->aFrame, 0) < 0)
+		return false;
+
+	if (!initializeEncoderSwresample(&s->audioSwr, ctx) || avF.swrInit(s->audioSwr) < 0)
+		return false;
+
+	s->aPacket = avF.packetAlloc();
+	return s->aPacket != nullptr;
 }
 
-std::queue<AVFrame*>* loadAudioMainRoutine(AVFormatContext *fmtContext, songInformation &info, size_t &audioLen)
+// frames of stereo S16, at most the frame size
+static bool encodeAudioFrame(encoderSession *s, const short *samples, int frames)
 {
-	std::queue<AVFrame*>* ret = nullptr;
-	songInformation *sInfo = nullptr;
-	songMetadata *sMeta = nullptr;
-	const AVCodec *aCodec = nullptr, *vCodec = nullptr;
-	AVCodecContext *aCodecCtx = nullptr, *vCodecCtx = nullptr;
-	SwrContext *swr = nullptr;
-	SwsContext *sws = nullptr;
-	AVPacket *packet = nullptr;
-	AVFrame *tempFrame = nullptr;
-	int64_t delay = 0;
-	int rval = 0;
+	if (avF.frameMakeWritable(s->aFrame) < 0)
+		return false;
 
-	avF.dumpFormat(fmtContext, 0, "None", 0);
+	const uint8_t *in[] = {(const uint8_t *) samples};
+	s->aFrame->nb_samples = frames;
+	if (avF.swrConvert(s->audioSwr, s->aFrame->data, frames, in, frames) < 0)
+		return false;
 
-	// assume it's already open
-	if (avF.formatFindStreamInfo(fmtContext, nullptr) < 0)
-		return nullptr;
+	s->aFrame->pts = s->audioSamples;
+	s->audioSamples += frames;
+	return encodePackets(s, s->aCodecContext, s->aFrame, s->aPacket, s->formatContext->streams[s->formatContext->nb_streams - 1]);
+}
 
-	// use "video" stream for cover art
-	AVStream *aStream = nullptr, *vStream = nullptr;
-	int aStreamIndex = -1, vStreamIndex = -1;
-	for (unsigned int i = 0; i < fmtContext->nb_streams && (aStream == nullptr || vStream == nullptr); i++)
+static void convertSlice(encoderSession *s, encoderSlot *slot, size_t index)
+{
+	int y = s->sliceRows[index], h = s->sliceRows[index + 1] - y;
+	// bottom-up rows are read with negative stride from the last row
+	int row = slot->flip ? s->height - 1 - y : y;
+	const uint8_t *src[] = {slot->data + ptrdiff_t(row) * slot->stride};
+	int srcLinesize[] = {slot->flip ? -slot->stride : slot->stride};
+
+	// written straight into the frame planes, chroma planes are subsampled
+	uint8_t *dst[AV_NUM_DATA_POINTERS] = {};
+	for (int i = 0; i < 4 && slot->frame->data[i]; i++)
 	{
-		AVMediaType x = fmtContext->streams[i]->codecpar->codec_type;
+		int shift = i == 1 || i == 2 ? s->chromaShift : 0;
+		dst[i] = slot->frame->data[i] + ptrdiff_t(y >> shift) * slot->frame->linesize[i];
+	}
 
-		if (x == AVMEDIA_TYPE_AUDIO && aStream == nullptr)
-			aStream = fmtContext->streams[aStreamIndex = i];
-		else if (x == AVMEDIA_TYPE_VIDEO && vStream == nullptr)
-			vStream = fmtContext->streams[vStreamIndex = i];
+	avF.swsScale(s->sliceContexts[index], src, srcLinesize, 0, h, dst, slot->frame->linesize);
+}
+
+static void convertFrame(encoderSession *s, encoderSlot *slot)
+{
+	size_t count = s->sliceContexts.size();
+	if (count > 1)
+	{
+		std::lock_guard<std::mutex> lock(s->sliceMutex);
+		s->sliceSlot = slot;
+		s->slicesPending = count - 1;
+		s->sliceGeneration++;
+		s->sliceStart.notify_all();
 	}
-	if (aStream == nullptr)
-		return nullptr;
 
-	// read metadata
-	sInfo = (songInformation*) avF.malloc(sizeof(songInformation));
-	size_t metadataCount = avF.dictCount(fmtContext->metadata);
-	if (metadataCount > 0)
-	{
-		AVDictionaryEntry *entry = nullptr;
-		int i = 0;
-		sMeta = (songMetadata*) avF.malloc(sizeof(songMetadata) * metadataCount);
-		entry = avF.dictGet(fmtContext->metadata, "", entry, AV_DICT_IGNORE_SUFFIX);
-		while (entry != nullptr)
-		{
-			char *k = avF.strdup(entry->key);
-			char *v = avF.strdup(entry->value);
-			sMeta[i++] = {strlen(k), k, strlen(v), v};
-			entry = avF.dictGet(fmtContext->metadata, "", entry, AV_DICT_IGNORE_SUFFIX);
-		}
+	convertSlice(s, slot, 0);
+
+	if (count > 1)
+	{
+		std::unique_lock<std::mutex> lock(s->sliceMutex);
+		s->sliceDone.wait(lock, [&]() {return s->slicesPending == 0;});
 	}
+}
 
-	// Set sample rate
-	sInfo->sampleRate = aStream->codecpar->sample_rate;
+static void runSliceThread(encoderSession *s, size_t index)
+{
+	uint64_t generation = 0;
 
-	// get codec
-	aCodec = avF.codecFindDecoder(aStream->codecpar->codec_id);
-	vCodec = nullptr;
-	if (aCodec == nullptr)
-		goto cleanup;
-	if (vStream)
-		// if no decoder for the cover art is present, that's okay
-		vCodec = avF.codecFindDecoder(vStream->codecpar->codec_id);
+	for (;;)
+	{
+		encoderSlot *slot;
+		{
+			std::unique_lock<std::mutex> lock(s->sliceMutex);
+			s->sliceStart.wait(lock, [&]() {return s->sliceStop || s->sliceGeneration != generation;});
+			if (s->sliceStop)
+				return;
 
-	// initialize decoder
-	aCodecCtx = avF.codecAllocContext(aCodec);
-	if (aCodecCtx == nullptr)
-		goto cleanup;
-	if (vCodec)
-		if ((vCodecCtx = avF.codecAllocContext(vCodec)) == nullptr)
-			goto cleanup;
+			generation = s->sliceGeneration;
+			slot = s->sliceSlot;
+		}
 
-	// initialize parameters
-	avF.codecParametersToContext(aCodecCtx, aStream->codecpar);
+		convertSlice(s, slot, index);
 
-	if (vCodecCtx)
-		avF.codecParametersToContext(vCodecCtx, vStream->codecpar);
+		std::lock_guard<std::mutex> lock(s->sliceMutex);
+		if (--s->slicesPending == 0)
+			s->sliceDone.notify_one();
+	}
+}
 
-	// open codec
-	if (avF.codecOpen(aCodecCtx, aCodec, nullptr) < 0 || (vCodec && avF.codecOpen(vCodecCtx, vCodec, nullptr) < 0))
-		goto cleanup;
+// threadCount 0 picks one band per 640x360 pixels, up to the core count
+static bool createSliceContexts(encoderSession *s, int width, int height, AVPixelFormat format, int threadCount)
+{
+	const AVPixFmtDescriptor *desc = avF.pixFmtDescGet(format);
+	if (desc == nullptr)
+		return false;
+	s->chromaShift = desc->log2_chroma_h;
 
-	// init swr
-	if (!initializeSwresample(&swr, aCodecCtx))
-		goto cleanup;
-	if (avF.swrInit(swr) < 0)
-		goto cleanup;
-	if (vCodecCtx)
+	if (threadCount <= 0)
+	{
+		int cores = std::max(int(std::thread::hardware_concurrency()), 1);
+		threadCount = std::min(std::max(int(int64_t(width) * height / (640 * 360)), 1), cores);
+	}
+
+	// bands start on a chroma row
+	int align = 1 << s->chromaShift;
+	int rows = (height + align - 1) / align;
+	threadCount = std::min(threadCount, rows);
+	for (int i = 0; i <= threadCount; i++)
+		s->sliceRows.push_back(std::min(rows * i / threadCount * align, height));
+
+	for (int i = 0; i < threadCount; i++)
 	{
-		sws = avF.swsGetContext(
-			vStream->codecpar->width, vStream->codecpar->height,
-			(AVPixelFormat) vStream->codecpar->format,
-			vStream->codecpar->width, vStream->codecpar->height,
-			AV_PIX_FMT_RGBA,
-			SWS_BILINEAR,
-			nullptr, nullptr, nullptr
+		SwsContext *sws = avF.swsGetContext(
+			width, s->sliceRows[i + 1] - s->sliceRows[i], AV_PIX_FMT_RGBA, // src (supplier)
+			width, s->sliceRows[i + 1] - s->sliceRows[i], format, // dest (encode)
+			SWS_BILINEAR, // flags
+			nullptr, nullptr, nullptr // other
 		);
 		if (sws == nullptr)
-			goto cleanup;
+			return false;
+
+		s->sliceContexts.push_back(sws);
 	}
 
-	// start decoding
-	packet = avF.packetAlloc();
-	tempFrame = avF.frameAlloc();
-	ret = new std::queue<AVFrame*>;
-	audioLen = 0;
-	rval = avF.readPacket(fmtContext, packet);
+	return true;
+}
 
-	while (rval >= 0)
+static void runConverter(encoderSession *s)
+{
+	for (;;)
 	{
-		bool isV = vStream && packet->stream_index == vStreamIndex;
-		bool isA = packet->stream_index == aStreamIndex;
-		bool processPacket = isV || isA;
-		if (processPacket)
+		encoderSlot *slot;
 		{
-			AVCodecContext *ctx = isV ? vCodecCtx : aCodecCtx;
-
-			int r = avF.codecSendPacket(ctx, packet);
-			if (r < 0)
+			std::unique_lock<std::mutex> lock(s->mutex);
+			s->changed.wait(lock, [&]() {return !s->converting.empty() || s->closing;});
+			if (s->converting.empty())
 			{
-				avF.packetUnref(packet);
-				deleteQueue(ret);
-				goto cleanup;
+				s->encoding.push_back(nullptr);
+				s->changed.notify_all();
+				return;
 			}
-			while (r >= 0)
-			{
-				r = avF.codecReceiveFrame(ctx, tempFrame);
 
-				if (r == AVERROR(EAGAIN) || r == AVERROR_EOF)
-					break;
-				else if (r < 0)
-				{
-					printAVError(r);
-					avF.packetUnref(packet);
-					deleteQueue(ret);
-					goto cleanup;
-				}
-				
-				if (packet->stream_index == aStreamIndex)
-				{
-					// audio decode
-					AVFrame *frame = avF.frameAlloc();
-					frame->format = AV_SAMPLE_FMT_S16;
-					frame->nb_samples = tempFrame->nb_samples;
-					frame->sample_rate = tempFrame->sample_rate;
-					setFrameChannelLayout(frame, AV_CH_LAYOUT_STEREO);
-					fixChannelLayout(tempFrame);
-
-					// swr_convert_frame will call av_frame_get_buffer
-					if (avF.frameGetBuffer(frame, 0) < 0)
-					{
-						avF.frameFree(&frame);
-						avF.packetUnref(packet);
-						deleteQueue(ret);
-						goto cleanup;
-					}
-					int convertResult = avF.swrConvertFrame(swr, frame, tempFrame);
-					if (convertResult < 0)
-					{
-						printAVError(convertResult);
-						avF.frameFree(&frame);
-						avF.packetUnref(packet);
-						deleteQueue(ret);
-						goto cleanup;
-					}
-
-					ret->push(frame);
-					audioLen += frame->nb_samples;
-				}
-				else
-				{
-					// video decode
-					uint8_t *imageData[4];
-					int lineSizes[4];
+			slot = s->converting.front();
+			s->converting.pop_front();
+		}
 
-					if (avF.imageAlloc(imageData, lineSizes, tempFrame->width, tempFrame->height, AV_PIX_FMT_RGBA, 1) < 0)
-					{
-						avF.packetUnref(packet);
-						deleteQueue(ret);
-						goto cleanup;
-					}
+		// the encoder may still hold a reference to the previous picture
+		double start = clockTime();
+		bool ok = avF.frameMakeWritable(slot->frame) >= 0;
+		if (ok)
+		{
+			convertFrame(s, slot);
+			recordStage(s, ENCODER_STAGE_CONVERT, clockTime() - start);
+		}
 
-					if (avF.swsScale(sws, tempFrame->data, tempFrame->linesize, 0, tempFrame->height, imageData, lineSizes) < 0)
-					{
+		std::lock_guard<std::mutex> lock(s->mutex);
+		if (ok)
+			s->encoding.push_back(slot);
+		else
+		{
+			s->failed = true;
+			s->idle.push_back(slot);
+		}
+		s->changed.notify_all();
+	}
+}
+
+static void runEncoder(encoderSession *s)
+{
+	// ENCODER_TIMING_CFR keeps the last frame to fill gaps with it
+	encoderSlot *previous = nullptr;
+
+	for (;;)
+	{
+		encoderSlot *slot;
+		bool failed;
+		{
+			std::unique_lock<std::mutex> lock(s->mutex);
+			s->changed.wait(lock, [&]() {return !s->encoding.empty();});
+			slot = s->encoding.front();
+			s->encoding.pop_front();
+			failed = s->failed;
+
+			if (slot == nullptr)
+			{
+				if (previous)
+					s->idle.push_back(previous);
+				s->changed.notify_all();
+				return;
+			}
+		}
+
+		// after a failure slots are only recycled so nothing waits forever
+		bool ok = failed;
+		if (!failed)
+		{
+			ok = true;
+			int64_t pts = slot->frame->pts;
+			for (int64_t i = previous ? slot->duplicates : 0; ok && i > 0; i--)
+			{
+				previous->frame->pts = pts - i;
+				ok = encodeFrame(s, previous->frame);
+			}
+			ok = ok && encodeFrame(s, slot->frame);
+		}
+
+		std::lock_guard<std::mutex> lock(s->mutex);
+		s->failed = s->failed || !ok;
+		if (s->timing == ENCODER_TIMING_CFR)
+			std::swap(slot, previous);
+		if (slot)
+			s->idle.push_back(slot);
+		s->changed.notify_all();
+	}
+}
+
+static bool startPipeline(encoderSession *s, int timing)
+{
+	s->dropFrames = encoderBackpressure == ENCODER_DROP;
+	s->timing = timing;
+	// one slot is held by the encoding thread with ENCODER_TIMING_CFR
+	s->slots.resize(std::max(encoderQueueSize, size_t(timing == ENCODER_TIMING_CFR ? 2 : 1)), {nullptr, nullptr, 0, 0, 0, false});
+
+	for (encoderSlot &slot: s->slots)
+	{
+		slot.capacity = size_t(s->width) * s->height * 4;
+		slot.data = (uint8_t *) avF.malloc(slot.capacity);
+		slot.frame = avF.frameAlloc();
+		if (slot.data == nullptr || slot.frame == nullptr)
+			return false;
+
+		slot.frame->format = s->vCodecContext->pix_fmt;
+		slot.frame->width = s->width;
+		slot.frame->height = s->height;
+		if (avF.frameGetBuffer(slot.frame, 32) < 0)
+			return false;
+
+		s->idle.push_back(&slot);
+	}
+
+	try
+	{
+		for (size_t i = 1; i < s->sliceContexts.size(); i++)
+			s->sliceThreads.emplace_back(runSliceThread, s, i);
+		s->converter = std::thread(runConverter, s);
+	}
+	catch (const std::system_error &)
+	{
+		return false;
+	}
+
+	try
+	{
+		s->encoder = std::thread(runEncoder, s);
+	}
+	catch (const std::system_error &)
+	{
+		// let the conversion thread exit
+		{
+			std::lock_guard<std::mutex> lock(s->mutex);
+			s->closing = true;
+			s->changed.notify_all();
+		}
+		s->converter.join();
+		return false;
+	}
+
+	return true;
+}
+
+// pixel format when the options don't name one
+static AVPixelFormat defaultPixelFormat(const char *encoder, bool lossless)
+{
+	if (strcmp(encoder, "libx264rgb") == 0)
+		return AV_PIX_FMT_BGR0;
+	// png: pixel format = rgb24
+	else if (strcmp(encoder, "png") == 0)
+		return AV_PIX_FMT_RGB24;
+	// keep full chroma when nothing may be lost
+	else if (lossless && strcmp(encoder, "libx264") == 0)
+		return AV_PIX_FMT_YUV444P;
+	else if (lossless && strcmp(encoder, "libvpx-vp9") == 0)
+		return AV_PIX_FMT_GBRP;
+
+	return AV_PIX_FMT_YUV420P;
+}
+
+// startSession settings, the old fixed ones
+static const encoderOptions losslessEncoderOptions = {nullptr, "slow", 0, 0, nullptr, 0, 0, nullptr, true, 0, ENCODER_TIMING_FRAME, 0};
+
+// everything up to the header, the pipeline is started by the caller
+static bool openEncoderRoutine(encoderSession *s, const char *output, int width, int height, int framerate, const encoderOptions &options)
+{
+	const char *encoder = options.encoder ? options.encoder : usedEncoder;
+	const AVCodec *vCodec = avF.codecFindEncoderByName(encoder);
+	if (vCodec == nullptr || options.timing < ENCODER_TIMING_FRAME || options.timing > ENCODER_TIMING_VFR)
+		return false;
+	// VFR timestamps are in milliseconds
+	AVRational timeBase = {1, options.timing == ENCODER_TIMING_VFR ? 1000 : framerate};
+
+	// open output context
+	if (avF.formatAllocOutputContext(&s->formatContext, nullptr, nullptr, output) < 0)
+		return false;
+	// open file
+	if ((s->formatContext->oformat->flags & AVFMT_NOFILE) == 0)
+		if (avF.ioOpen(&s->formatContext->pb, output, AVIO_FLAG_WRITE) < 0)
+			return false;
+
+	// new video stream
+	AVStream *vStream = avF.formatNewStream(s->formatContext, vCodec);
+	if (vStream == nullptr)
+		return false;
+	vStream->id = s->formatContext->nb_streams - 1;
+	vStream->time_base = timeBase;
+	vStream->avg_frame_rate = {framerate, 1};
+	vStream->codecpar->width = width;
+	vStream->codecpar->height = height;
+
+	// new codec context
+	AVCodecContext *ctx = s->vCodecContext = avF.codecAllocContext(vCodec);
+	if (ctx == nullptr)
+		return false;
+
+	// Set codec context values
+	ctx->width = width;
+	ctx->height = height;
+	ctx->time_base = timeBase;
+	ctx->framerate = {framerate, 1};
+	ctx->pix_fmt = defaultPixelFormat(encoder, options.lossless);
+	ctx->thread_count = options.threadCount;
+	if (options.pixelFormat && (ctx->pix_fmt = avF.getPixelFormat(options.pixelFormat)) == AV_PIX_FMT_NONE)
+		return false;
+	if (options.gopSize > 0)
+		ctx->gop_size = options.gopSize;
+	if (options.bitRate > 0)
+		ctx->bit_rate = options.bitRate;
+
+	// x264-specific: use crf=0, libvpx-vp9-specific: use lossless=1
+	if (options.lossless && strstr(encoder, "libx264"))
+		avF.optSet(ctx->priv_data, "crf", "0", 0);
+	else if (options.lossless && strcmp(encoder, "libvpx-vp9") == 0)
+		avF.optSet(ctx->priv_data, "lossless", "1", 0);
+	else if (options.crf > 0)
+	{
+		char crf[32];
+		snprintf(crf, sizeof(crf), "%g", options.crf);
+		avF.optSet(ctx->priv_data, "crf", crf, 0);
+	}
+	// not every encoder has presets, that's fine
+	if (options.preset)
+		avF.optSet(ctx->priv_data, "preset", options.preset, 0);
+
+	// but explicitly requested options must exist
+	for (const char *const *opt = options.extraOptions; opt && opt[0] && opt[1]; opt += 2)
+	{
+		if (avF.optSet(ctx, opt[0], opt[1], AV_OPT_SEARCH_CHILDREN) < 0)
+			return false;
+	}
+
+	if (s->formatContext->oformat->flags & AVFMT_GLOBALHEADER)
+		ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	// Open codec
+	if (avF.codecOpen(ctx, vCodec, nullptr) < 0)
+		return false;
+
+	avF.codecParametersFromContext(vStream->codecpar, ctx);
+
+	if (options.sampleRate > 0 && !openAudioEncoder(s, options.sampleRate))
+		return false;
+
+	if (!createSliceContexts(s, width, height, ctx->pix_fmt, options.conversionThreads))
+		return false;
+
+	// new packet
+	s->packet = avF.packetAlloc();
+	if (s->packet == nullptr)
+		return false;
+
+	// write header
+	int ret = avF.formatWriteHeader(s->formatContext, nullptr);
+	if (ret < 0)
+	{
+		printAVError(ret);
+		return false;
+	}
+	// debug
+	avF.dumpFormat(s->formatContext, 0, output, true);
+	s->width = width; s->height = height; s->framerate = framerate;
+	return true;
+}
+
+encoderSession *openEncoderSession(const char *output, int width, int height, int framerate, const encoderOptions &options)
+{
+	if (!encodingSupported) return nullptr;
+
+	encoderSession *s = new (std::nothrow) encoderSession();
+	if (s == nullptr)
+		return nullptr;
+
+	if (!openEncoderRoutine(s, output, width, height, framerate, options) || !startPipeline(s, options.timing))
+	{
+		freeEncoderSession(s);
+		return nullptr;
+	}
+
+	return s;
+}
+
+// timeline position of a frame supplied at time, false if it's too early
+// for the timeline and must be dropped
+static bool placeFrame(encoderSession *s, double time, int64_t &pts, int64_t &duplicates)
+{
+	duplicates = 0;
+	if (s->timing == ENCODER_TIMING_FRAME)
+	{
+		pts = s->nextPts;
+		return true;
+	}
+
+	if (s->nextPts == 0)
+		s->startTime = time;
+
+	if (s->timing == ENCODER_TIMING_VFR)
+		pts = llround((time - s->startTime) * 1000.0);
+	else
+	{
+		pts = llround((time - s->startTime) * s->framerate);
+		duplicates = pts - s->nextPts;
+	}
+	return pts >= s->nextPts;
+}
+
+static bool supplyFrame(encoderSession *s, const void *videoData, double time, int stride, bool flip)
+{
+	if (stride == 0)
+		stride = s->width * 4;
+	else if (stride < s->width * 4)
+		return false;
+
+	std::unique_lock<std::mutex> lock(s->mutex);
+	if (!s->dropFrames)
+		s->changed.wait(lock, [&]() {return !s->idle.empty() || s->failed;});
+	if (s->failed)
+		return false;
+
+	int64_t pts, duplicates;
+	bool placed = placeFrame(s, time, pts, duplicates);
+	// dropped frames still advance the timeline, leaving a gap instead of
+	// drift. With timestamps the gap is filled with the next frame instead
+	if (placed && s->timing == ENCODER_TIMING_FRAME)
+		s->nextPts++;
+	if (!placed || s->idle.empty())
+	{
+		s->dropped++;
+		return true;
+	}
+	if (s->timing != ENCODER_TIMING_FRAME)
+	{
+		s->nextPts = pts + 1;
+		s->duplicated += size_t(duplicates);
+	}
+
+	encoderSlot *slot = s->idle.front();
+	s->idle.pop_front();
+	lock.unlock();
+
+	// rows are kept as supplied, padding of the last row is not read
+	double start = clockTime();
+	size_t size = size_t(s->height - 1) * stride + size_t(s->width) * 4;
+	if (size > slot->capacity)
+	{
+		uint8_t *data = (uint8_t *) avF.malloc(size);
+		if (data == nullptr)
+		{
+			lock.lock();
+			s->idle.push_back(slot);
+			s->dropped++;
+			s->changed.notify_all();
+			return true;
+		}
+
+		avF.free(slot->data);
+		slot->data = data;
+		slot->capacity = size;
+	}
+
+	memcpy(slot->data, videoData, size);
+	slot->stride = stride;
+	slot->flip = flip;
+	slot->frame->pts = pts;
+	slot->duplicates = duplicates;
+	recordStage(s, ENCODER_STAGE_COPY, clockTime() - start);
+
+	lock.lock();
+	s->converting.push_back(slot);
+	s->changed.notify_all();
+	return true;
+}
+
+bool supplyEncoderSessionTimed(encoderSession *s, const void *videoData, double time)
+{
+	return supplyFrame(s, videoData, time, 0, false);
+}
+
+bool supplyEncoderSession(encoderSession *s, const void *videoData)
+{
+	return supplyFrame(s, videoData, clockTime(), 0, false);
+}
+
+bool supplyEncoderSessionStridedTimed(encoderSession *s, const void *videoData, double time, int stride, bool flip)
+{
+	return supplyFrame(s, videoData, time, stride, flip);
+}
+
+bool supplyEncoderSessionStrided(encoderSession *s, const void *videoData, int stride, bool flip)
+{
+	return supplyFrame(s, videoData, clockTime(), stride, flip);
+}
+
+void getEncoderSessionFrameCounts(encoderSession *s, size_t &dropped, size_t &duplicated)
+{
+	std::lock_guard<std::mutex> lock(s->mutex);
+	dropped = s->dropped;
+	duplicated = s->duplicated;
+}
+
+void getEncoderSessionStats(encoderSession *s, encoderStats &stats)
+{
+	{
+		std::lock_guard<std::mutex> lock(s->mutex);
+		stats.queueSize = s->slots.size();
+		stats.idle = s->idle.size();
+		stats.converting = s->converting.size();
+		// without the end marker of the conversion thread
+		stats.encoding = s->encoding.size();
+		if (stats.encoding > 0 && s->encoding.back() == nullptr)
+			stats.encoding--;
+		stats.dropped = s->dropped;
+		stats.duplicated = s->duplicated;
+	}
+
+	std::lock_guard<std::mutex> lock(s->statsMutex);
+	std::copy(s->stages, s->stages + ENCODER_STAGE_COUNT, stats.stages);
+	stats.encodedFrames = s->encodedFrames;
+	stats.encodedBytes = s->encodedBytes;
+	stats.bitRate = s->muxedTime > 0 ? double(s->encodedBytes) * 8.0 / s->muxedTime : 0;
+}
+
+bool supplyEncoderSessionAudio(encoderSession *s, const short *samples, size_t sampleCount)
+{
+	std::lock_guard<std::mutex> lock(s->audioMutex);
+	if (s->aCodecContext == nullptr)
+		return false;
+
+	s->audioPending.insert(s->audioPending.end(), samples, samples + sampleCount * 2);
+
+	size_t offset = 0;
+	bool ok = true;
+	while (ok && s->audioPending.size() - offset >= s->audioFrameSize * 2)
+	{
+		ok = encodeAudioFrame(s, s->audioPending.data() + offset, int(s->audioFrameSize));
+		offset += s->audioFrameSize * 2;
+	}
+
+	s->audioPending.erase(s->audioPending.begin(), s->audioPending.begin() + offset);
+	return ok;
+}
+
+void closeEncoderSession(encoderSession *s)
+{
+	// queued frames are still encoded
+	{
+		std::lock_guard<std::mutex> lock(s->mutex);
+		s->closing = true;
+		s->changed.notify_all();
+	}
+	s->converter.join();
+	s->encoder.join();
+
+	// Flush
+	if (!s->failed)
+		encodeFrame(s, nullptr);
+
+	{
+		std::lock_guard<std::mutex> lock(s->audioMutex);
+		if (s->aCodecContext)
+		{
+			// the last frame is padded with silence unless the encoder takes a short one
+			size_t frames = s->audioPending.size() / 2;
+			int caps = s->aCodecContext->codec->capabilities;
+			if (frames > 0 && (caps & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) == 0)
+			{
+				frames = s->audioFrameSize;
+				s->audioPending.resize(frames * 2, 0);
+			}
+			if (frames == 0 || encodeAudioFrame(s, s->audioPending.data(), int(frames)))
+				encodePackets(s, s->aCodecContext, nullptr, s->aPacket, s->formatContext->streams[s->formatContext->nb_streams - 1]);
+		}
+	}
+
+	// write trailer
+	avF.interleavedWriteFrame(s->formatContext, nullptr);
+	avF.writeTrailer(s->formatContext);
+	freeEncoderSession(s);
+}
+
+bool startSessionEx(const char *output, int width, int height, int framerate, const encoderOptions &options)
+{
+	if (g_Session) return false;
+
+	g_Session = openEncoderSession(output, width, height, framerate, options);
+	return g_Session != nullptr;
+}
+
+bool startSession(const char *output, int width, int height, int framerate)
+{
+	return startSessionEx(output, width, height, framerate, losslessEncoderOptions);
+}
+
+bool startSessionWithAudio(const char *output, int width, int height, int framerate, int sampleRate)
+{
+	encoderOptions options = losslessEncoderOptions;
+	options.sampleRate = sampleRate;
+	return sampleRate > 0 && startSessionEx(output, width, height, framerate, options);
+}
+
+bool supply(const void *videoData)
+{
+	return g_Session && supplyEncoderSession(g_Session, videoData);
+}
+
+bool supplyTimed(const void *videoData, double time)
+{
+	return g_Session && supplyEncoderSessionTimed(g_Session, videoData, time);
+}
+
+bool supplyStrided(const void *videoData, int stride, bool flip)
+{
+	return g_Session && supplyEncoderSessionStrided(g_Session, videoData, stride, flip);
+}
+
+bool supplyStridedTimed(const void *videoData, double time, int stride, bool flip)
+{
+	return g_Session && supplyEncoderSessionStridedTimed(g_Session, videoData, time, stride, flip);
+}
+
+bool supplyAudio(const short *samples, size_t sampleCount)
+{
+	return g_Session && supplyEncoderSessionAudio(g_Session, samples, sampleCount);
+}
+
+void getEncoderFrameCounts(size_t &dropped, size_t &duplicated)
+{
+	dropped = duplicated = 0;
+	if (g_Session)
+		getEncoderSessionFrameCounts(g_Session, dropped, duplicated);
+}
+
+bool getEncoderStats(encoderStats &stats)
+{
+	if (g_Session == nullptr)
+		return false;
+
+	getEncoderSessionStats(g_Session, stats);
+	return true;
+}
+
+void endSession()
+{
+	if (g_Session == nullptr) return;
+
+	closeEncoderSession(g_Session);
+	g_Session = nullptr;
+}
+
+// Interleaved output buffer, allocated with av_realloc so it can be av_free'd
+struct sampleBuffer
+{
+	short *data;
+	// in sample frames
+	size_t length, capacity;
+	// bytes per sample frame, 4 for stereo S16
+	size_t frameSize;
+};
+
+static bool reserveSamples(sampleBuffer &buffer, size_t count)
+{
+	size_t needed = buffer.length + count;
+	if (needed <= buffer.capacity)
+		return true;
+
+	// estimate was short, grow geometrically
+	size_t newCapacity = buffer.capacity + buffer.capacity / 2;
+	if (newCapacity < needed)
+		newCapacity = needed;
+
+	short *newData = (short*) avF.realloc(buffer.data, newCapacity * buffer.frameSize);
+	if (newData == nullptr)
+		return false;
+
+	buffer.data = newData;
+	buffer.capacity = newCapacity;
+	return true;
+}
+
+// in seconds, 0 if unknown
+static double streamDuration(AVFormatContext *fmtContext, AVStream *stream)
+{
+	if (stream->duration != AV_NOPTS_VALUE && stream->duration > 0)
+		return stream->duration * av_q2d(stream->time_base);
+	else if (fmtContext->duration != AV_NOPTS_VALUE && fmtContext->duration > 0)
+		return fmtContext->duration / double(AV_TIME_BASE);
+
+	return 0;
+}
+
+// outRate 0 is the stream sample rate
+static size_t estimateSampleCount(AVFormatContext *fmtContext, AVStream *stream, int outRate = 0)
+{
+	double sampleRate = outRate > 0 ? outRate : stream->codecpar->sample_rate;
+	double duration = streamDuration(fmtContext, stream);
+	if (duration <= 0)
+		duration = 60.0; // unknown, guess a minute
+
+	// durations are rarely sample-exact (encoder delay, padding), leave some room
+	size_t estimate = size_t(duration * sampleRate);
+	return estimate + estimate / 64 + 8192;
+}
+
+// null frame flushes swresample, returns 0 or AVERROR code
+static int convertSamples(SwrContext *swr, sampleBuffer &buffer, const AVFrame *frame)
+{
+	int inCount = frame ? frame->nb_samples : 0;
+	int outCount = avF.swrGetOutSamples(swr, inCount);
+	if (outCount < 0)
+		return outCount;
+	if (!reserveSamples(buffer, size_t(outCount)))
+		return AVERROR(ENOMEM);
+
+	uint8_t *out[] = {((uint8_t*) buffer.data) + buffer.length * buffer.frameSize};
+	int r = avF.swrConvert(swr, out, outCount, frame ? (const uint8_t**) frame->extended_data : nullptr, inCount);
+	if (r < 0)
+	{
+		printAVError(r);
+		return r;
+	}
+
+	buffer.length += size_t(r);
+	return 0;
+}
+
+template<typename T> static void analyzeSamples(waveform::builder *wave, loudness::meter *meter, const T *samples, size_t frames, int channels)
+{
+	if (wave)
+		wave->add(samples, frames, channels);
+	if (meter)
+		meter->add(samples, frames);
+}
+
+// feed samples converted since the last call to the waveform summary and loudness meter
+static void analyzeSamples(waveform::builder *wave, loudness::meter *meter, const sampleBuffer &buffer, size_t &analyzed, int channels, AVSampleFormat format)
+{
+	if (analyzed >= buffer.length)
+		return;
+
+	const uint8_t *start = ((const uint8_t *) buffer.data) + analyzed * buffer.frameSize;
+	size_t frames = buffer.length - analyzed;
+	if (format == AV_SAMPLE_FMT_S16)
+		analyzeSamples(wave, meter, (const short *) start, frames, channels);
+	else if (format == AV_SAMPLE_FMT_FLT)
+		analyzeSamples(wave, meter, (const float *) start, frames, channels);
+	else if (format == AV_SAMPLE_FMT_DBL)
+		analyzeSamples(wave, meter, (const double *) start, frames, channels);
+
+	analyzed = buffer.length;
+}
+
+// frame sample position at sampleRate relative to the stream start, -1 if unknown
+static int64_t frameSamplePosition(AVStream *stream, const AVFrame *frame, size_t sampleRate)
+{
+	int64_t pts = frame->best_effort_timestamp != AV_NOPTS_VALUE ? frame->best_effort_timestamp : frame->pts;
+	if (pts == AV_NOPTS_VALUE)
+		return -1;
+	if (stream->start_time != AV_NOPTS_VALUE)
+		pts -= stream->start_time;
+
+	return int64_t(pts * av_q2d(stream->time_base) * double(sampleRate) + 0.5);
+}
+
+// Part of the song kept by loadAudioMainRoutine, in output sample frames
+struct sampleRange
+{
+	int64_t start;
+	// -1 is until the end
+	int64_t end;
+	// position of the next converted sample, -1 until the first frame
+	int64_t position;
+	bool active, done;
+};
+
+// drop samples converted since from that are outside the range
+static void trimToRange(sampleBuffer &buffer, size_t from, sampleRange &range)
+{
+	if (!range.active)
+		return;
+
+	int64_t first = range.position;
+	int64_t count = int64_t(buffer.length - from);
+	range.position += count;
+
+	// leading part, decoding starts at the keyframe before the start
+	if (first < range.start)
+	{
+		int64_t drop = std::min(range.start - first, count);
+		uint8_t *chunk = ((uint8_t *) buffer.data) + from * buffer.frameSize;
+		memmove(chunk, chunk + drop * buffer.frameSize, size_t(count - drop) * buffer.frameSize);
+		buffer.length -= size_t(drop);
+		first += drop;
+		count -= drop;
+	}
+
+	if (range.end >= 0 && first + count >= range.end)
+	{
+		int64_t keep = std::max(std::min(range.end - first, count), int64_t(0));
+		buffer.length = from + size_t(keep);
+		range.done = true;
+	}
+}
+
+// Cancellation and progress of a decode running on another thread
+struct decodeControl
+{
+	std::atomic<bool> cancel;
+	// 0 to 1, estimated from the audio packet timestamps
+	std::atomic<float> progress;
+};
+
+// AVIOInterruptCB, aborts blocking I/O once cancelled
+static int checkCancel(void *opaque)
+{
+	return ((decodeControl *) opaque)->cancel.load();
+}
+
+// first audio stream, and the cover art: attached picture or else first video stream
+static void findSongStreams(AVFormatContext *fmtContext, AVStream *&aStream, AVStream *&vStream)
+{
+	aStream = vStream = nullptr;
+	for (unsigned int i = 0; i < fmtContext->nb_streams; i++)
+	{
+		AVStream *stream = fmtContext->streams[i];
+		AVMediaType x = stream->codecpar->codec_type;
+
+		if (x == AVMEDIA_TYPE_AUDIO && aStream == nullptr)
+			aStream = stream;
+		else if (x == AVMEDIA_TYPE_VIDEO && (vStream == nullptr || (
+			(stream->disposition & AV_DISPOSITION_ATTACHED_PIC) &&
+			(vStream->disposition & AV_DISPOSITION_ATTACHED_PIC) == 0
+		)))
+			vStream = stream;
+	}
+}
+
+// Allocates coverSize bytes for the cover art followed by the metadata
+// array and its strings, so one free releases everything. Fills metadata
+// and metadataCount of info, data receives the cover art part (or null if
+// there's nothing to allocate). Returns 0 or AVERROR code
+static int allocateSongData(AVDictionary *dict, songInformation &info, size_t coverSize, uint8_t *&data)
+{
+	size_t count = size_t(avF.dictCount(dict)), stringSize = 0;
+	AVDictionaryEntry *entry = nullptr;
+	while ((entry = avF.dictGet(dict, "", entry, AV_DICT_IGNORE_SUFFIX)) != nullptr)
+		stringSize += strlen(entry->key) + strlen(entry->value) + 2;
+
+	coverSize = (coverSize + alignof(songMetadata) - 1) / alignof(songMetadata) * alignof(songMetadata);
+	size_t total = coverSize + sizeof(songMetadata) * count + stringSize;
+	data = nullptr;
+	info.metadata = nullptr;
+	info.metadataCount = 0;
+	if (total == 0)
+		return 0;
+
+	if ((data = (uint8_t *) avF.malloc(total)) == nullptr)
+		return AVERROR(ENOMEM);
+	if (count == 0)
+		return 0;
+
+	songMetadata *sMeta = (songMetadata *) (data + coverSize);
+	char *str = (char *) (sMeta + count);
+	size_t i = 0;
+	while ((entry = avF.dictGet(dict, "", entry, AV_DICT_IGNORE_SUFFIX)) != nullptr && i < count)
+	{
+		size_t keySize = strlen(entry->key), valueSize = strlen(entry->value);
+		// null terminators come from the zeroed allocation
+		memcpy(str, entry->key, keySize);
+		memcpy(str + keySize + 1, entry->value, valueSize);
+		sMeta[i++] = {keySize, str, valueSize, str + keySize + 1};
+		str += keySize + valueSize + 2;
+	}
+
+	info.metadata = sMeta;
+	info.metadataCount = i;
+	return 0;
+}
+
+// metadata only, when there's no cover art to share the allocation with
+static int readMetadata(AVDictionary *dict, songInformation &info)
+{
+	uint8_t *data;
+	return allocateSongData(dict, info, 0, data);
+}
+
+static void freeSongData(songInformation &info)
+{
+	avF.free(info.coverArt ? (void *) info.coverArt : (void *) info.metadata);
+	info.coverArt = nullptr;
+	info.metadata = nullptr;
+	info.metadataCount = 0;
+}
+
+static const decodeOptions defaultDecodeOptions = {};
+
+// false if the options ask for something unsupported
+static bool getSampleOutput(const decodeOptions &options, int &channels, AVSampleFormat &format, size_t &frameSize)
+{
+	size_t sampleSize;
+	channels = options.channelCount > 0 ? int(options.channelCount) : 2;
+
+	switch (options.sampleFormat)
+	{
+		case SAMPLE_FORMAT_S16:
+			format = AV_SAMPLE_FMT_S16;
+			sampleSize = 2;
+			break;
+		case SAMPLE_FORMAT_FLOAT:
+			format = AV_SAMPLE_FMT_FLT;
+			sampleSize = 4;
+			break;
+#ifdef LS2X_USE_KISSFFT
+		case SAMPLE_FORMAT_FFT_SCALAR:
+			// ready for fftr3 and fftr4
+			static_assert(sizeof(kiss_fft_scalar) == 4 || sizeof(kiss_fft_scalar) == 8, "kiss_fft_scalar must be float or double");
+			format = sizeof(kiss_fft_scalar) == 8 ? AV_SAMPLE_FMT_DBL : AV_SAMPLE_FMT_FLT;
+			sampleSize = sizeof(kiss_fft_scalar);
+			break;
+#endif
+		default:
+			return false;
+	}
+
+	if (channels > 8)
+		return false;
+
+	frameSize = sampleSize * size_t(channels);
+	return true;
+}
+
+// scale src into dst, both RGBA unless srcFormat says otherwise
+static int scaleImage(const uint8_t *const *src, const int *srcLinesize, int srcWidth, int srcHeight, AVPixelFormat srcFormat, uint8_t *dst, int dstWidth, int dstHeight)
+{
+	// area averaging when shrinking, big covers alias badly otherwise
+	int flags = dstWidth < srcWidth || dstHeight < srcHeight ? SWS_AREA : SWS_BILINEAR;
+	SwsContext *sws = avF.swsGetContext(
+		srcWidth, srcHeight, srcFormat,
+		dstWidth, dstHeight, AV_PIX_FMT_RGBA,
+		flags,
+		nullptr, nullptr, nullptr
+	);
+	if (sws == nullptr)
+		return AVERROR(EINVAL);
+
+	uint8_t *dstData[4] = {dst};
+	int dstLinesize[4] = {dstWidth * 4};
+	int ret = avF.swsScale(sws, src, srcLinesize, 0, srcHeight, dstData, dstLinesize);
+	avF.swsFreeContext(sws);
+	return ret < 0 ? ret : 0;
+}
+
+// RGBA copy of decoded cover art into info, shrunk to options.coverArtSize
+// followed by the mip levels and the metadata of dict, returns 0 or AVERROR code
+static int convertCoverArt(const AVFrame *frame, songInformation &info, const decodeOptions &options, AVDictionary *dict)
+{
+	int width = frame->width, height = frame->height;
+	int maxSize = int(options.coverArtSize);
+	if (width <= 0 || height <= 0)
+		return AVERROR_INVALIDDATA;
+
+	// keep aspect ratio
+	if (maxSize > 0 && (width > maxSize || height > maxSize))
+	{
+		if (width >= height)
+		{
+			height = std::max(int(int64_t(height) * maxSize / width), 1);
+			width = maxSize;
+		}
+		else
+		{
+			width = std::max(int(int64_t(width) * maxSize / height), 1);
+			height = maxSize;
+		}
+	}
+
+	// levels stop at 1x1
+	size_t levels = 1, total = size_t(width) * height * 4;
+	while (levels < options.coverArtMipCount && ((width >> (levels - 1)) > 1 || (height >> (levels - 1)) > 1))
+	{
+		total += size_t(std::max(width >> levels, 1)) * std::max(height >> levels, 1) * 4;
+		levels++;
+	}
+
+	uint8_t *imageData;
+	int ret = allocateSongData(dict, info, total, imageData);
+	if (ret < 0)
+		return ret;
+
+	ret = scaleImage(frame->data, frame->linesize, frame->width, frame->height, (AVPixelFormat) frame->format, imageData, width, height);
+
+	// each level from the previous one, halving is a plain box filter
+	uint8_t *level = imageData;
+	for (size_t i = 1; ret >= 0 && i < levels; i++)
+	{
+		int w = std::max(width >> (i - 1), 1), h = std::max(height >> (i - 1), 1);
+		const uint8_t *src[4] = {level};
+		int srcLinesize[4] = {w * 4};
+		uint8_t *next = level + size_t(w) * h * 4;
+
+		ret = scaleImage(src, srcLinesize, w, h, AV_PIX_FMT_RGBA, next, std::max(width >> i, 1), std::max(height >> i, 1));
+		level = next;
+	}
+
+	if (ret < 0)
+	{
+		avF.free(imageData);
+		info.metadata = nullptr;
+		info.metadataCount = 0;
+		return ret;
+	}
+
+	info.coverArtWidth = width;
+	info.coverArtHeight = height;
+	info.coverArt = (char *) imageData;
+	return 0;
+}
+
+// returns 0 or AVERROR code, control is optional
+static int loadAudioMainRoutine(AVFormatContext *fmtContext, songInformation &info, const decodeOptions &options, decodeControl *control)
+{
+	int ret = 0;
+	songInformation *sInfo = nullptr;
+	const AVCodec *aCodec = nullptr, *vCodec = nullptr;
+	AVCodecContext *aCodecCtx = nullptr, *vCodecCtx = nullptr;
+	SwrContext *swr = nullptr;
+	AVPacket *packet = nullptr;
+	AVFrame *tempFrame = nullptr;
+	sampleBuffer buffer = {nullptr, 0, 0, 0};
+	int rval = 0;
+	double duration = 0;
+	int outChannels = 2;
+	AVSampleFormat outFormat = AV_SAMPLE_FMT_S16;
+	waveform::builder *wave = nullptr;
+	loudness::meter *meter = nullptr;
+	size_t analyzed = 0, converted = 0;
+	sampleRange range = {0, -1, -1, false, false};
+	size_t estimate = 0;
+
+	if (!getSampleOutput(options, outChannels, outFormat, buffer.frameSize))
+		return AVERROR(EINVAL);
+
+	// assume it's already open and probed
+	avF.dumpFormat(fmtContext, 0, "None", 0);
+
+	// use "video" stream for cover art
+	AVStream *aStream, *vStream;
+	findSongStreams(fmtContext, aStream, vStream);
+	if (aStream == nullptr)
+		return AVERROR_STREAM_NOT_FOUND;
+	int aStreamIndex = aStream->index, vStreamIndex = vStream ? vStream->index : -1;
+
+	// metadata is read along with the cover art, or at the end
+	sInfo = (songInformation*) avF.malloc(sizeof(songInformation));
+	if (sInfo == nullptr)
+		return AVERROR(ENOMEM);
+
+	// Set sample rate
+	sInfo->sampleRate = options.sampleRate > 0 ? options.sampleRate : aStream->codecpar->sample_rate;
+
+	// get codec
+	aCodec = avF.codecFindDecoder(aStream->codecpar->codec_id);
+	vCodec = nullptr;
+	if (aCodec == nullptr)
+	{
+		ret = AVERROR_DECODER_NOT_FOUND;
+		goto cleanup;
+	}
+	if (vStream)
+		// if no decoder for the cover art is present, that's okay
+		vCodec = avF.codecFindDecoder(vStream->codecpar->codec_id);
+
+	// initialize decoder
+	aCodecCtx = avF.codecAllocContext(aCodec);
+	if (aCodecCtx == nullptr || (vCodec && (vCodecCtx = avF.codecAllocContext(vCodec)) == nullptr))
+	{
+		ret = AVERROR(ENOMEM);
+		goto cleanup;
+	}
+
+	// initialize parameters
+	avF.codecParametersToContext(aCodecCtx, aStream->codecpar);
+	applyDecoderThreading(aCodecCtx);
+
+	// cover art stays single-threaded, a frame-threaded decoder holds on to
+	// the only picture until it's flushed
+	if (vCodecCtx)
+		avF.codecParametersToContext(vCodecCtx, vStream->codecpar);
+
+	// open codec
+	if ((ret = avF.codecOpen(aCodecCtx, aCodec, nullptr)) < 0 || (vCodec && (ret = avF.codecOpen(vCodecCtx, vCodec, nullptr)) < 0))
+		goto cleanup;
+
+	// init swr
+	if (!initializeSwresample(&swr, aCodecCtx, int(options.sampleRate), outChannels, outFormat))
+	{
+		ret = AVERROR(EINVAL);
+		goto cleanup;
+	}
+	if ((ret = avF.swrInit(swr)) < 0)
+		goto cleanup;
+
+	if (options.waveformLevelCount > 0)
+	{
+		wave = new (std::nothrow) waveform::builder(options.waveformBucketSize, options.waveformLevelCount);
+		if (wave == nullptr)
+		{
+			ret = AVERROR(ENOMEM);
+			goto cleanup;
+		}
+	}
+	meter = new (std::nothrow) loudness::meter(sInfo->sampleRate, outChannels);
+	if (meter == nullptr)
+	{
+		ret = AVERROR(ENOMEM);
+		goto cleanup;
+	}
+
+	// time range, seek to the keyframe before it and trim to the sample later.
+	// if seeking fails decoding from the start still gives the right samples
+	estimate = estimateSampleCount(fmtContext, aStream, int(options.sampleRate));
+	if (options.startTime > 0 || options.endTime > 0)
+	{
+		range.active = true;
+		range.start = int64_t(std::max(options.startTime, 0.0) * sInfo->sampleRate + 0.5);
+		if (options.endTime > 0)
+		{
+			range.end = std::max(int64_t(options.endTime * sInfo->sampleRate + 0.5), range.start);
+			estimate = std::min(estimate, size_t(range.end - range.start) + 8192);
+		}
+
+		if (range.start > 0)
+		{
+			int64_t ts = int64_t(options.startTime / av_q2d(aStream->time_base));
+			if (aStream->start_time != AV_NOPTS_VALUE)
+				ts += aStream->start_time;
+			avF.seekFrame(fmtContext, aStreamIndex, ts, AVSEEK_FLAG_BACKWARD);
+		}
+	}
+
+	// start decoding, sized from the stream duration
+	packet = avF.packetAlloc();
+	tempFrame = avF.frameAlloc();
+	if (packet == nullptr || tempFrame == nullptr || !reserveSamples(buffer, estimate))
+	{
+		ret = AVERROR(ENOMEM);
+		goto cleanup;
+	}
+	duration = streamDuration(fmtContext, aStream);
+	rval = avF.readPacket(fmtContext, packet);
+
+	while (rval >= 0)
+	{
+		if (control)
+		{
+			if (control->cancel)
+			{
+				ret = AVERROR_EXIT;
+				avF.packetUnref(packet);
+				goto cleanup;
+			}
+
+			if (packet->stream_index == aStreamIndex && packet->pts != AV_NOPTS_VALUE && duration > 0)
+			{
+				int64_t pts = packet->pts;
+				if (aStream->start_time != AV_NOPTS_VALUE)
+					pts -= aStream->start_time;
+
+				double progress = pts * av_q2d(aStream->time_base) / duration;
+				control->progress = float(progress < 0 ? 0 : (progress > 1 ? 1 : progress));
+			}
+		}
+
+		bool isV = vStream && packet->stream_index == vStreamIndex;
+		bool isA = packet->stream_index == aStreamIndex;
+		bool processPacket = isV || isA;
+		if (processPacket)
+		{
+			AVCodecContext *ctx = isV ? vCodecCtx : aCodecCtx;
+
+			int r = avF.codecSendPacket(ctx, packet);
+			if (r < 0)
+			{
+				ret = r;
+				avF.packetUnref(packet);
+				goto cleanup;
+			}
+			while (r >= 0)
+			{
+				r = avF.codecReceiveFrame(ctx, tempFrame);
+
+				if (r == AVERROR(EAGAIN) || r == AVERROR_EOF)
+					break;
+				else if (r < 0)
+				{
+					printAVError(r);
+					ret = r;
+					avF.packetUnref(packet);
+					goto cleanup;
+				}
+				
+				if (packet->stream_index == aStreamIndex)
+				{
+					if (range.active && range.position < 0)
+						range.position = std::max(frameSamplePosition(aStream, tempFrame, sInfo->sampleRate), int64_t(0));
+
+					// audio decode, swresample writes to the output buffer directly
+					converted = buffer.length;
+					if ((ret = convertSamples(swr, buffer, tempFrame)) < 0)
+					{
+						avF.packetUnref(packet);
+						goto cleanup;
+					}
+					trimToRange(buffer, converted, range);
+					// while it's still in cache
+					analyzeSamples(wave, meter, buffer, analyzed, outChannels, outFormat);
+					if (range.done)
+						break;
+				}
+				else
+				{
+					// video decode
+					if ((ret = convertCoverArt(tempFrame, *sInfo, options, fmtContext->metadata)) < 0)
+					{
 						avF.packetUnref(packet);
-						deleteQueue(ret);
 						goto cleanup;
 					}
 
-					// set image data
-					sInfo->coverArtWidth = tempFrame->width;
-					sInfo->coverArtHeight = tempFrame->height;
-					sInfo->coverArt = (char *) imageData[0];
+					// done with video decoding
+					avF.codecFreeContext(&vCodecCtx);
+					vStream = nullptr;
+
+					break;
+				}
+			}
+		}
+
+		avF.packetUnref(packet);
+		// stop reading at the end of the range
+		rval = range.done ? AVERROR_EOF : avF.readPacket(fmtContext, packet);
+	}
+	if (rval != AVERROR_EOF)
+	{
+		ret = rval;
+		goto cleanup;
+	}
+
+	// flush decode
+	if (!range.done && avF.codecSendPacket(aCodecCtx, nullptr) >= 0)
+	{
+		while (!range.done && avF.codecReceiveFrame(aCodecCtx, tempFrame) >= 0)
+		{
+			if (range.active && range.position < 0)
+				range.position = std::max(frameSamplePosition(aStream, tempFrame, sInfo->sampleRate), int64_t(0));
+
+			converted = buffer.length;
+			if ((ret = convertSamples(swr, buffer, tempFrame)) < 0)
+				goto cleanup;
+			trimToRange(buffer, converted, range);
+		}
+	}
+
+	// flush swr
+	converted = buffer.length;
+	if (!range.done && (ret = convertSamples(swr, buffer, nullptr)) < 0)
+		goto cleanup;
+	if (range.position >= 0)
+		trimToRange(buffer, converted, range);
+	analyzeSamples(wave, meter, buffer, analyzed, outChannels, outFormat);
+	sInfo->integratedLoudness = meter->getIntegratedLoudness();
+	sInfo->loudnessRange = meter->getLoudnessRange();
+	sInfo->truePeak = meter->getTruePeak();
+
+	if (wave)
+	{
+		wave->finish();
+		void *summary = avF.malloc(wave->getSize());
+		if (summary == nullptr)
+		{
+			ret = AVERROR(ENOMEM);
+			goto cleanup;
+		}
+
+		sInfo->waveformLevelCount = wave->getLevelCount();
+		sInfo->waveform = wave->write(summary);
+	}
+
+	if (sInfo->coverArt == nullptr && (ret = readMetadata(fmtContext->metadata, *sInfo)) < 0)
+		goto cleanup;
+
+	// give back the unused part of the estimate
+	if (buffer.capacity > buffer.length)
+	{
+		short *shrunk = (short*) avF.realloc(buffer.data, (buffer.length + !buffer.length) * buffer.frameSize);
+		if (shrunk)
+			buffer.data = shrunk;
+	}
+
+	// set information
+	memcpy(&info, sInfo, sizeof(songInformation));
+	info.sampleCount = buffer.length;
+	info.samples = buffer.data;
+	info.channelCount = size_t(outChannels);
+	info.sampleFormat = options.sampleFormat;
+	ret = 0;
+	
+cleanup:
+	if (tempFrame)
+		avF.frameFree(&tempFrame);
+	if (packet)
+		avF.packetFree(&packet);
+	if (swr)
+		avF.swrFree(&swr);
+	if (aCodecCtx)
+		avF.codecFreeContext(&aCodecCtx);
+	if (vCodecCtx)
+		avF.codecFreeContext(&vCodecCtx);
+	delete wave;
+	delete meter;
+	if (ret < 0)
+	{
+		freeSongData(*sInfo);
+		avF.free(sInfo->waveform);
+		avF.free(buffer.data);
+	}
+	avF.free(sInfo); sInfo = nullptr;
+
+	return ret;
+}
+
+// Input which is not a file name, either memory or user callbacks
+struct ioSource
+{
+	const uint8_t *data;
+	size_t size, position;
+	ioReadCallback read;
+	ioSeekCallback seek;
+	void *userdata;
+};
+
+const int IO_BUFFER_SIZE = 65536;
+
+static int ioSourceRead(void *opaque, uint8_t *buf, int bufSize)
+{
+	ioSource *source = (ioSource *) opaque;
+	int r;
+
+	if (source->read)
+		r = source->read(source->userdata, buf, bufSize);
+	else
+	{
+		size_t maxRead = std::min(size_t(bufSize), source->size - source->position);
+		memcpy(buf, source->data + source->position, maxRead);
+		source->position += maxRead;
+		r = int(maxRead);
+	}
+
+	return r > 0 ? r : AVERROR_EOF;
+}
+
+static int64_t ioSourceSeek(void *opaque, int64_t offset, int whence)
+{
+	ioSource *source = (ioSource *) opaque;
+	whence &= ~AVSEEK_FORCE;
+
+	if (source->read)
+		return source->seek(source->userdata, offset, whence);
+
+	int64_t size = int64_t(source->size);
+	if (whence == SEEK_CUR)
+		offset += int64_t(source->position);
+	else if (whence == SEEK_END)
+		offset += size;
+	else if (whence == AVSEEK_SIZE)
+		return size;
+
+	source->position = size_t(offset > size ? size : (offset < 0 ? 0 : offset));
+	return int64_t(source->position);
+}
+
+static void freeIOContext(AVIOContext **io)
+{
+	if (*io == nullptr)
+		return;
+
+	// the buffer may have been reallocated by lavf
+	avF.free((*io)->buffer);
+#if LIBAVFORMAT_VERSION_MAJOR < 58
+	avF.free(*io);
+	*io = nullptr;
+#else
+	avF.ioFreeContext(io);
+#endif
+}
+
+// source and io are optional, io receives the context to free with
+// freeIOContext after the format context is closed
+static int openAudioInput(const char *input, AVFormatContext **fmtContext, decodeControl *control, ioSource *source = nullptr, AVIOContext **io = nullptr)
+{
+	if (control || source)
+	{
+		if ((*fmtContext = avF.formatAllocContext()) == nullptr)
+			return AVERROR(ENOMEM);
+	}
+
+	if (control)
+	{
+		// install the interrupt callback before anything blocks
+		(*fmtContext)->interrupt_callback.callback = checkCancel;
+		(*fmtContext)->interrupt_callback.opaque = control;
+	}
+
+	if (source)
+	{
+		uint8_t *buffer = (uint8_t *) avF.malloc(IO_BUFFER_SIZE);
+		bool seekable = source->read == nullptr || source->seek != nullptr;
+		if (buffer)
+			*io = avF.ioAllocContext(buffer, IO_BUFFER_SIZE, 0, source, ioSourceRead, nullptr, seekable ? ioSourceSeek : nullptr);
+		if (*io == nullptr)
+		{
+			avF.free(buffer);
+			avF.formatFreeContext(*fmtContext);
+			*fmtContext = nullptr;
+			return AVERROR(ENOMEM);
+		}
+
+		(*fmtContext)->pb = *io;
+		(*fmtContext)->flags |= AVFMT_FLAG_CUSTOM_IO;
+		input = nullptr;
+	}
 
-					// done with video decoding
-					avF.swsFreeContext(sws); sws = nullptr;
-					avF.codecFreeContext(&vCodecCtx);
-					vStream = nullptr;
+	// frees the context on failure, but not the custom IO
+	int r = avF.formatOpenInput(fmtContext, input, nullptr, nullptr);
+	if (r < 0)
+	{
+		if (io)
+			freeIOContext(io);
+		return r;
+	}
 
-					break;
-				}
-			}
-		}
+	r = avF.formatFindStreamInfo(*fmtContext, nullptr);
+	if (r < 0)
+	{
+		avF.formatCloseInput(fmtContext);
+		if (io)
+			freeIOContext(io);
+	}
+	return r;
+}
 
-		avF.packetUnref(packet);
-		rval = avF.readPacket(fmtContext, packet);
+// Bounds the estimated decoded size of files being decoded at once
+struct memoryBudget
+{
+	std::mutex mutex;
+	std::condition_variable released;
+	size_t used, limit;
+
+	void acquire(size_t size)
+	{
+		// always let one file through, even if it's over the limit
+		std::unique_lock<std::mutex> lock(mutex);
+		released.wait(lock, [&]() {return limit == 0 || used == 0 || used + size <= limit;});
+		used += size;
 	}
-	if (rval != AVERROR_EOF)
+
+	void release(size_t size)
 	{
-		deleteQueue(ret);
-		goto cleanup;
+		std::lock_guard<std::mutex> lock(mutex);
+		used -= size;
+		released.notify_all();
 	}
-	// flush decode
+};
+
+static size_t estimateDecodedSize(AVFormatContext *fmtContext)
+{
+	for (unsigned int i = 0; i < fmtContext->nb_streams; i++)
 	{
-		int r = avF.codecSendPacket(aCodecCtx, nullptr);
-		if (r >= 0)
+		if (fmtContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+			return estimateSampleCount(fmtContext, fmtContext->streams[i]) * sizeof(short) * 2;
+	}
+
+	return 0;
+}
+
+static int loadAudioFileRoutine(const char *input, songInformation &info, const decodeOptions &options, memoryBudget *budget, decodeControl *control, ioSource *source = nullptr)
+{
+	AVFormatContext *fmtContext = nullptr;
+	AVIOContext *io = nullptr;
+	int ret = openAudioInput(input, &fmtContext, control, source, &io);
+	if (ret < 0)
+		return ret;
+
+	size_t size = budget ? estimateDecodedSize(fmtContext) : 0;
+	if (budget)
+		budget->acquire(size);
+
+	ret = loadAudioMainRoutine(fmtContext, info, options, control);
+
+	if (budget)
+		budget->release(size);
+	avF.formatCloseInput(&fmtContext);
+	freeIOContext(&io);
+	return ret;
+}
+
+// decode a single cover art packet, returns 0 or AVERROR code
+static int decodeCoverArt(AVStream *stream, const AVPacket *packet, songInformation &info, const decodeOptions &options, AVDictionary *dict)
+{
+	const AVCodec *codec = avF.codecFindDecoder(stream->codecpar->codec_id);
+	if (codec == nullptr)
+		return AVERROR_DECODER_NOT_FOUND;
+
+	AVCodecContext *ctx = avF.codecAllocContext(codec);
+	AVFrame *frame = avF.frameAlloc();
+	int ret = AVERROR(ENOMEM);
+	if (
+		ctx && frame &&
+		(ret = avF.codecParametersToContext(ctx, stream->codecpar)) >= 0 &&
+		(ret = avF.codecOpen(ctx, codec, nullptr)) >= 0 &&
+		(ret = avF.codecSendPacket(ctx, packet)) >= 0 &&
+		(ret = avF.codecSendPacket(ctx, nullptr)) >= 0 &&
+		(ret = avF.codecReceiveFrame(ctx, frame)) >= 0
+	)
+		ret = convertCoverArt(frame, info, options, dict);
+
+	if (frame)
+		avF.frameFree(&frame);
+	if (ctx)
+		avF.codecFreeContext(&ctx);
+	return ret;
+}
+
+bool probeAudioFile(const char *input, songInformation &info, const decodeOptions &options)
+{
+	if (!libavSatisfied) return false;
+
+	AVFormatContext *fmtContext = nullptr;
+	if (avF.formatOpenInput(&fmtContext, input, nullptr, nullptr) < 0)
+		return false;
+
+	// container header is usually enough, only probe packets when it's not.
+	// Some formats (e.g. CBR MP3 without Xing header) only get a duration
+	// estimate from find_stream_info
+	AVStream *aStream, *vStream;
+	findSongStreams(fmtContext, aStream, vStream);
+	if (aStream == nullptr || aStream->codecpar->sample_rate == 0 || streamDuration(fmtContext, aStream) <= 0)
+	{
+		if (avF.formatFindStreamInfo(fmtContext, nullptr) >= 0)
+			findSongStreams(fmtContext, aStream, vStream);
+	}
+	if (aStream == nullptr || aStream->codecpar->sample_rate == 0)
+	{
+		avF.formatCloseInput(&fmtContext);
+		return false;
+	}
+
+	memset(&info, 0, sizeof(songInformation));
+	info.sampleRate = aStream->codecpar->sample_rate;
+	// estimated, samples is null
+	info.sampleCount = size_t(streamDuration(fmtContext, aStream) * info.sampleRate + 0.5);
+	// what loading with the same options gives
+	info.channelCount = options.channelCount > 0 ? options.channelCount : 2;
+	info.sampleFormat = options.sampleFormat;
+
+	// a cover art that can't be decoded fails the probe, like loadAudioFile
+	int ret = 0;
+	if (vStream && (vStream->disposition & AV_DISPOSITION_ATTACHED_PIC))
+		// already read with the header
+		ret = decodeCoverArt(vStream, &vStream->attached_pic, info, options, fmtContext->metadata);
+	else if (vStream)
+	{
+		// read up to the first picture, skipping everything else
+		for (unsigned int i = 0; i < fmtContext->nb_streams; i++)
 		{
-			r = avF.codecReceiveFrame(aCodecCtx, tempFrame);
-			while (r >= 0)
+			if (fmtContext->streams[i] != vStream)
+				fmtContext->streams[i]->discard = AVDISCARD_ALL;
+		}
+
+		AVPacket *packet = avF.packetAlloc();
+		if (packet == nullptr)
+			ret = AVERROR(ENOMEM);
+		else
+		{
+			while (avF.readPacket(fmtContext, packet) >= 0)
 			{
-				// audio decode
-				AVFrame *frame = avF.frameAlloc();
-				frame->format = AV_SAMPLE_FMT_S16;
-				frame->nb_samples = tempFrame->nb_samples;
-				setFrameChannelLayout(frame, AV_CH_LAYOUT_STEREO);
-
-				// swr_convert_frame will call av_frame_get_buffer
-				if (avF.swrConvertFrame(swr, frame, tempFrame) < 0)
-				{
-					avF.frameFree(&frame);
-					deleteQueue(ret);
-					goto cleanup;
-				}
-				ret->push(frame);
-				audioLen += frame->nb_samples;
+				bool found = packet->stream_index == vStream->index;
+				if (found)
+					ret = decodeCoverArt(vStream, packet, info, options, fmtContext->metadata);
+				avF.packetUnref(packet);
+				if (found)
+					break;
 			}
+			avF.packetFree(&packet);
 		}
 	}
 
-	// flush swr
-	delay = avF.swrGetDelay(swr, aStream->codecpar->sample_rate);
-	if (delay > 0)
+	if (ret < 0)
+	{
+		freeSongData(info);
+		avF.formatCloseInput(&fmtContext);
+		return false;
+	}
+
+	// shares the cover art allocation if there's one
+	if (info.coverArt == nullptr)
+		readMetadata(fmtContext->metadata, info);
+
+	avF.formatCloseInput(&fmtContext);
+	return true;
+}
+
+bool loadAudioFile(const char *input, songInformation &info)
+{
+	if (!libavSatisfied) return false;
+	return loadAudioFileRoutine(input, info, defaultDecodeOptions, nullptr, nullptr) == 0;
+}
+
+bool loadAudioFileEx(const char *input, songInformation &info, const decodeOptions &options)
+{
+	if (!libavSatisfied) return false;
+	return loadAudioFileRoutine(input, info, options, nullptr, nullptr) == 0;
+}
+
+bool loadAudioMemory(const void *data, size_t size, songInformation &info, const decodeOptions &options)
+{
+	if (!libavSatisfied) return false;
+
+	ioSource source = {(const uint8_t *) data, size, 0, nullptr, nullptr, nullptr};
+	return loadAudioFileRoutine(nullptr, info, options, nullptr, nullptr, &source) == 0;
+}
+
+bool loadAudioIO(ioReadCallback read, ioSeekCallback seek, void *userdata, songInformation &info, const decodeOptions &options)
+{
+	if (!libavSatisfied || read == nullptr) return false;
+
+	ioSource source = {nullptr, 0, 0, read, seek, userdata};
+	return loadAudioFileRoutine(nullptr, info, options, nullptr, nullptr, &source) == 0;
+}
+
+void loadAudioFiles(const char *const *inputs, size_t count, songInformation *infos, int *errors, int threadCount, size_t memoryLimit)
+{
+	if (!libavSatisfied)
 	{
-		AVFrame *frame = avF.frameAlloc();
-		frame->format = AV_SAMPLE_FMT_S16;
-		frame->nb_samples = (int) delay;
-		setFrameChannelLayout(frame, AV_CH_LAYOUT_STEREO);
+		for (size_t i = 0; i < count; i++)
+			errors[i] = AVERROR(ENOSYS);
+		return;
+	}
 
-		if (avF.frameGetBuffer(frame, 0) < 0)
+	memoryBudget budget;
+	budget.used = 0;
+	budget.limit = memoryLimit;
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]()
+	{
+		for (size_t i = next++; i < count; i = next++)
 		{
-			avF.frameFree(&frame);
-			deleteQueue(ret);
-			goto cleanup;
+			memset(&infos[i], 0, sizeof(songInformation));
+			errors[i] = loadAudioFileRoutine(inputs[i], infos[i], defaultDecodeOptions, &budget, nullptr);
 		}
-		avF.swrConvert(swr, frame->data, (int) delay, nullptr, 0);
-		ret->push(frame);
-		audioLen += frame->nb_samples;
+	};
+
+	if (threadCount <= 0)
+		threadCount = int(std::thread::hardware_concurrency());
+	if (size_t(threadCount) > count)
+		threadCount = int(count);
+
+	// calling thread is one of the workers, if no more threads can be
+	// started the ones already running share the queue
+	std::vector<std::thread> workers;
+	try
+	{
+		for (int i = 1; i < threadCount; i++)
+			workers.emplace_back(worker);
 	}
-	// set information
-	memcpy(&info, sInfo, sizeof(songInformation));
-	info.metadata = sMeta;
-	info.metadataCount = metadataCount;
-	
-cleanup:
-	if (tempFrame)
-		avF.frameFree(&tempFrame);
-	if (packet)
-		avF.packetFree(&packet);
-	if (swr)
-		avF.swrFree(&swr);
-	if (sws)
-		avF.swsFreeContext(sws);
-	if (aCodecCtx)
-		avF.codecFreeContext(&aCodecCtx);
-	if (vCodecCtx)
-		avF.codecFreeContext(&vCodecCtx);
-	if (ret == nullptr && metadataCount > 0)
+	catch (const std::system_error &) {}
+	worker();
+
+	for (std::thread &t: workers)
+		t.join();
+}
+
+static void freeSongInformation(songInformation &info)
+{
+	freeSongData(info);
+	avF.free(info.waveform);
+	avF.free(info.samples);
+}
+
+struct audioJob
+{
+	std::string input;
+	decodeControl control;
+	std::mutex mutex;
+	std::condition_variable finished;
+	bool done, taken;
+	int result;
+	songInformation info;
+	// held by the worker and the caller, last one out deletes
+	std::atomic<int> references;
+};
+
+static void releaseAudioJob(audioJob *job)
+{
+	if (--job->references == 0)
+	{
+		// nobody took the result
+		if (job->result == 0 && !job->taken)
+			freeSongInformation(job->info);
+		delete job;
+	}
+}
+
+static void runAudioJob(audioJob *job)
+{
+	int ret = AVERROR_EXIT;
+	if (!job->control.cancel)
+		ret = loadAudioFileRoutine(job->input.c_str(), job->info, defaultDecodeOptions, nullptr, &job->control);
+
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->result = ret;
+		job->done = true;
+		if (ret == 0)
+			job->control.progress = 1;
+		job->finished.notify_all();
+	}
+
+	releaseAudioJob(job);
+}
+
+audioJob *loadAudioFileAsync(const char *input)
+{
+	if (!libavSatisfied) return nullptr;
+
+	audioJob *job = new (std::nothrow) audioJob;
+	if (job == nullptr)
+		return nullptr;
+
+	job->input = input;
+	job->control.cancel = false;
+	job->control.progress = 0;
+	job->done = job->taken = false;
+	job->result = AVERROR(EAGAIN);
+	memset(&job->info, 0, sizeof(songInformation));
+	job->references = 2;
+
+	try
+	{
+		std::thread(runAudioJob, job).detach();
+	}
+	catch (const std::system_error &)
+	{
+		delete job;
+		return nullptr;
+	}
+
+	return job;
+}
+
+bool pollAudioJob(audioJob *job)
+{
+	std::lock_guard<std::mutex> lock(job->mutex);
+	return job->done;
+}
+
+bool waitAudioJob(audioJob *job, double timeout)
+{
+	std::unique_lock<std::mutex> lock(job->mutex);
+	if (timeout < 0)
+		job->finished.wait(lock, [job]() {return job->done;});
+	else
+		job->finished.wait_for(lock, std::chrono::duration<double>(timeout), [job]() {return job->done;});
+
+	return job->done;
+}
+
+void cancelAudioJob(audioJob *job)
+{
+	job->control.cancel = true;
+}
+
+double getAudioJobProgress(audioJob *job)
+{
+	return job->control.progress;
+}
+
+int getAudioJobResult(audioJob *job, songInformation &info)
+{
+	std::lock_guard<std::mutex> lock(job->mutex);
+	if (!job->done)
+		return AVERROR(EAGAIN);
+	if (job->result < 0)
+		return job->result;
+	if (job->taken)
+		return AVERROR(EINVAL);
+
+	memcpy(&info, &job->info, sizeof(songInformation));
+	job->taken = true;
+	return 0;
+}
+
+void freeAudioJob(audioJob *job)
+{
+	if (job == nullptr)
+		return;
+
+	// the worker finishes in the background, it stops at the next packet
+	job->control.cancel = true;
+	releaseAudioJob(job);
+}
+
+struct audioStream
+{
+	AVFormatContext *fmtContext;
+	AVCodecContext *codecCtx;
+	SwrContext *swr;
+	AVPacket *packet;
+	AVFrame *frame;
+	AVStream *stream;
+	// converted samples not yet returned to the caller
+	sampleBuffer pending;
+	size_t pendingOffset;
+	// sample position to trim to after seeking, -1 if not seeking
+	int64_t seekTarget;
+	bool draining, finished;
+};
+
+void closeAudioStream(audioStream *s)
+{
+	if (s == nullptr)
+		return;
+
+	if (s->frame)
+		avF.frameFree(&s->frame);
+	if (s->packet)
+		avF.packetFree(&s->packet);
+	if (s->swr)
+		avF.swrFree(&s->swr);
+	if (s->codecCtx)
+		avF.codecFreeContext(&s->codecCtx);
+	if (s->fmtContext)
+		avF.formatCloseInput(&s->fmtContext);
+	avF.free(s->pending.data);
+	avF.free(s);
+}
+
+audioStream *openAudioStream(const char *input, audioStreamInfo &info)
+{
+	if (!libavSatisfied) return nullptr;
+
+	audioStream *s = (audioStream*) avF.malloc(sizeof(audioStream));
+	if (s == nullptr)
+		return nullptr;
+	s->seekTarget = -1;
+	s->pending.frameSize = sizeof(short) * 2;
+
+	if (openAudioInput(input, &s->fmtContext, nullptr) < 0)
+	{
+		closeAudioStream(s);
+		return nullptr;
+	}
+
+	// first audio stream, the rest is discarded
+	for (unsigned int i = 0; i < s->fmtContext->nb_streams; i++)
+	{
+		AVStream *stream = s->fmtContext->streams[i];
+		if (s->stream == nullptr && stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+			s->stream = stream;
+		else
+			stream->discard = AVDISCARD_ALL;
+	}
+	if (s->stream == nullptr)
+	{
+		closeAudioStream(s);
+		return nullptr;
+	}
+
+	const AVCodec *codec = avF.codecFindDecoder(s->stream->codecpar->codec_id);
+	if (
+		codec == nullptr ||
+		(s->codecCtx = avF.codecAllocContext(codec)) == nullptr ||
+		avF.codecParametersToContext(s->codecCtx, s->stream->codecpar) < 0
+	)
+	{
+		closeAudioStream(s);
+		return nullptr;
+	}
+
+	applyDecoderThreading(s->codecCtx);
+	if (
+		avF.codecOpen(s->codecCtx, codec, nullptr) < 0 ||
+		!initializeSwresample(&s->swr, s->codecCtx) ||
+		avF.swrInit(s->swr) < 0 ||
+		(s->packet = avF.packetAlloc()) == nullptr ||
+		(s->frame = avF.frameAlloc()) == nullptr
+	)
+	{
+		closeAudioStream(s);
+		return nullptr;
+	}
+
+	info.sampleRate = s->codecCtx->sample_rate;
+	info.duration = streamDuration(s->fmtContext, s->stream);
+
+	return s;
+}
+
+static bool decodeStreamFrame(audioStream *s)
+{
+	while (true)
 	{
-		for (int i = 0; i < metadataCount; i++)
+		int r = avF.codecReceiveFrame(s->codecCtx, s->frame);
+		if (r >= 0)
+			return true;
+		else if (r != AVERROR(EAGAIN) || s->draining)
+			// end of stream or decode error
+			return false;
+
+		// decoder needs more input
+		r = avF.readPacket(s->fmtContext, s->packet);
+		if (r < 0)
+		{
+			if (r != AVERROR_EOF)
+				printAVError(r);
+			// drain decoder
+			s->draining = true;
+			avF.codecSendPacket(s->codecCtx, nullptr);
+			continue;
+		}
+
+		if (s->packet->stream_index == s->stream->index)
+			r = avF.codecSendPacket(s->codecCtx, s->packet);
+		avF.packetUnref(s->packet);
+
+		if (r < 0 && r != AVERROR_INVALIDDATA)
 		{
-			avF.free(sMeta[i].key);
-			avF.free(sMeta[i].value);
+			printAVError(r);
+			return false;
 		}
-		avF.free(sMeta); sMeta = nullptr;
 	}
-	avF.free(sInfo); sInfo = nullptr;
+}
 
-	return ret;
+// frame sample position relative to the stream start, -1 if unknown
+static int64_t frameSamplePosition(audioStream *s, const AVFrame *frame)
+{
+	return frameSamplePosition(s->stream, frame, s->codecCtx->sample_rate);
 }
 
-short *loadAudioConcat(std::queue<AVFrame*> *&queue, size_t smpSize)
+// refill pending samples, false at end of stream
+static bool refillAudioStream(audioStream *s)
 {
-	short *smp = (short*) avF.malloc(smpSize * sizeof(short) * 2);
-	if (smp == nullptr)
-		return nullptr;
+	s->pending.length = s->pendingOffset = 0;
 
-	short *curPos = smp;
-	size_t s = queue->size();
-	while (s-- > 0)
+	while (s->pending.length == 0)
 	{
-		AVFrame *temp = queue->front();
-		queue->pop();
-		memcpy(curPos, temp->data[0], temp->nb_samples * sizeof(short) * 2);
-		curPos += temp->nb_samples * 2;
-		avF.frameFree(&temp);
+		if (s->finished)
+			return false;
+
+		if (!decodeStreamFrame(s))
+		{
+			// flush swr and stop
+			s->finished = true;
+			if (convertSamples(s->swr, s->pending, nullptr) < 0)
+				return false;
+			continue;
+		}
+
+		int64_t position = s->seekTarget >= 0 ? frameSamplePosition(s, s->frame) : -1;
+		if (convertSamples(s->swr, s->pending, s->frame) < 0)
+			return false;
+
+		if (position >= 0)
+		{
+			// trim to the seek target
+			int64_t skip = s->seekTarget - position;
+			if (skip >= int64_t(s->pending.length))
+			{
+				s->pending.length = 0;
+				continue;
+			}
+			else if (skip > 0)
+				s->pendingOffset = size_t(skip);
+		}
+		s->seekTarget = -1;
 	}
 
-	delete queue; queue = nullptr;
-	return smp;
+	return true;
 }
 
-bool loadAudioFile(const char *input, songInformation &info)
+size_t readAudioStream(audioStream *s, short *dest, size_t sampleCount)
 {
-	bool ret = false;
-	if (!libavSatisfied) return false;
+	size_t done = 0;
 
-	AVFormatContext *fmtContext = nullptr;
-	if (avF.formatOpenInput(&fmtContext, input, nullptr, nullptr) < 0)
-		return false;
+	while (done < sampleCount)
+	{
+		if (s->pendingOffset >= s->pending.length && !refillAudioStream(s))
+			break;
 
-	size_t smpLen;
-	short *sample = nullptr;
-	std::queue<AVFrame*> *queue = loadAudioMainRoutine(fmtContext, info, smpLen);
-	if (queue == nullptr)
-		goto cleanup;
+		size_t count = s->pending.length - s->pendingOffset;
+		if (count > sampleCount - done)
+			count = sampleCount - done;
 
-	sample = loadAudioConcat(queue, smpLen);
-	if (sample == nullptr)
-		goto cleanup;
+		memcpy(dest + done * 2, s->pending.data + s->pendingOffset * 2, count * sizeof(short) * 2);
+		s->pendingOffset += count;
+		done += count;
+	}
 
-	info.sampleCount = smpLen;
-	info.samples = sample;
-	ret = true;
+	return done;
+}
 
-cleanup:
-	if (queue)
-		deleteQueue(queue);
-	if (fmtContext)
-		avF.formatCloseInput(&fmtContext);
-	return ret;
+bool seekAudioStream(audioStream *s, double time)
+{
+	if (time < 0)
+		time = 0;
+
+	int64_t ts = int64_t(time / av_q2d(s->stream->time_base));
+	if (s->stream->start_time != AV_NOPTS_VALUE)
+		ts += s->stream->start_time;
+
+	if (avF.seekFrame(s->fmtContext, s->stream->index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+		return false;
+
+	// drop everything buffered before the seek
+	avF.flushBuffers(s->codecCtx);
+	avF.swrInit(s->swr);
+	s->pending.length = s->pendingOffset = 0;
+	s->seekTarget = int64_t(time * s->codecCtx->sample_rate + 0.5);
+	s->draining = s->finished = false;
+	return true;
 }
 
 bool hasEncodingSupported()
@@ -808,8 +2627,44 @@ const std::map<std::string, void*> &getFunctions()
 		{std::string("encodingSupported"), (void*) hasEncodingSupported},
 		{std::string("startEncodingSession"), (void*) startSession},
 		{std::string("supplyEncoder"), (void*) supply},
+		{std::string("supplyEncoderTimed"), (void*) supplyTimed},
+		{std::string("supplyEncoderStrided"), (void*) supplyStrided},
+		{std::string("supplyEncoderStridedTimed"), (void*) supplyStridedTimed},
+		{std::string("getEncoderFrameCounts"), (void*) getEncoderFrameCounts},
+		{std::string("getEncoderStats"), (void*) getEncoderStats},
+		{std::string("openEncoderSession"), (void*) openEncoderSession},
+		{std::string("supplyEncoderSession"), (void*) supplyEncoderSession},
+		{std::string("supplyEncoderSessionTimed"), (void*) supplyEncoderSessionTimed},
+		{std::string("supplyEncoderSessionStrided"), (void*) supplyEncoderSessionStrided},
+		{std::string("supplyEncoderSessionStridedTimed"), (void*) supplyEncoderSessionStridedTimed},
+		{std::string("supplyEncoderSessionAudio"), (void*) supplyEncoderSessionAudio},
+		{std::string("getEncoderSessionFrameCounts"), (void*) getEncoderSessionFrameCounts},
+		{std::string("getEncoderSessionStats"), (void*) getEncoderSessionStats},
+		{std::string("closeEncoderSession"), (void*) closeEncoderSession},
 		{std::string("endEncodingSession"), (void*) endSession},
+		{std::string("startEncodingSessionWithAudio"), (void*) startSessionWithAudio},
+		{std::string("startEncodingSessionEx"), (void*) startSessionEx},
+		{std::string("supplyAudioEncoder"), (void*) supplyAudio},
+		{std::string("setEncoderPipeline"), (void*) setEncoderPipeline},
 		{std::string("loadAudioFile"), (void*) loadAudioFile},
+		{std::string("loadAudioFileEx"), (void*) loadAudioFileEx},
+		{std::string("loadAudioMemory"), (void*) loadAudioMemory},
+		{std::string("loadAudioIO"), (void*) loadAudioIO},
+		{std::string("loadAudioFiles"), (void*) loadAudioFiles},
+		{std::string("probeAudioFile"), (void*) probeAudioFile},
+		{std::string("av_strerror"), (void*) avF.strerror},
+		{std::string("loadAudioFileAsync"), (void*) loadAudioFileAsync},
+		{std::string("pollAudioJob"), (void*) pollAudioJob},
+		{std::string("waitAudioJob"), (void*) waitAudioJob},
+		{std::string("cancelAudioJob"), (void*) cancelAudioJob},
+		{std::string("getAudioJobProgress"), (void*) getAudioJobProgress},
+		{std::string("getAudioJobResult"), (void*) getAudioJobResult},
+		{std::string("freeAudioJob"), (void*) freeAudioJob},
+		{std::string("setDecoderThreading"), (void*) setDecoderThreading},
+		{std::string("openAudioStream"), (void*) openAudioStream},
+		{std::string("readAudioStream"), (void*) readAudioStream},
+		{std::string("seekAudioStream"), (void*) seekAudioStream},
+		{std::string("closeAudioStream"), (void*) closeAudioStream},
 		{std::string("av_free"), (void*) avF.free},
 	};
 	return funcs;
@@ -10,6 +10,8 @@
 #include <string>
 
 #include "dynwrap/dynwrap.h"
+#include "loudness.h"
+#include "waveform.h"
 extern "C"
 {
 // libav
@@ -19,6 +21,7 @@ extern "C"
 #include "libavutil/frame.h"
 #include "libavutil/imgutils.h"
 #include "libavutil/opt.h"
+#include "libavutil/pixdesc.h"
 #include "libswscale/swscale.h"
 #include "libswresample/swresample.h"
 }
@@ -45,7 +48,7 @@ struct libavFunctions
 #undef LOAD_AVFUNC
 };
 
-// meant to be allocated via av_malloc
+// part of the cover art/metadata block of songInformation
 struct songMetadata
 {
 	// utf8 null-terminated string
@@ -60,18 +63,244 @@ struct songInformation
 	// whole pointer must be freed using av_free
 	size_t sampleRate;
 	size_t sampleCount;
+	// EBU R128 integrated loudness (LUFS), loudness range (LU) and true
+	// peak (dBTP), measured while decoding. -inf if silent
+	double integratedLoudness, loudnessRange, truePeak;
+	// stereo S16 unless decodeOptions says otherwise
 	short *samples;
+	// cover art, then the metadata array and its strings share one
+	// allocation. Free coverArt, or metadata if there's no cover art
 	size_t metadataCount;
 	songMetadata *metadata;
 	size_t coverArtWidth, coverArtHeight;
 	char *coverArt;
+	// levels and their buckets in one allocation, see decodeOptions
+	size_t waveformLevelCount;
+	waveform::level *waveform;
+	// interleaved channels and sampleFormat of samples
+	size_t channelCount;
+	int sampleFormat;
+};
+// decodeOptions sampleFormat
+enum sampleFormat
+{
+	SAMPLE_FORMAT_S16 = 0,
+	SAMPLE_FORMAT_FLOAT = 1,
+	// float or double, whichever the FFT module is built with
+	SAMPLE_FORMAT_FFT_SCALAR = 2
+};
+// zero-initialized is the loadAudioFile behaviour
+struct decodeOptions
+{
+	// longest cover art side in pixels, 0 keeps the original size
+	size_t coverArtSize;
+	// amount of cover art levels, each half the size of the previous one,
+	// stored one after another in coverArt. 0 or 1 is the base image only
+	size_t coverArtMipCount;
+	// output sample rate, 0 keeps the file sample rate
+	size_t sampleRate;
+	// interleaved output channels (up to 8), 0 is stereo
+	size_t channelCount;
+	// sampleFormat, samples points to this type instead of short
+	int sampleFormat;
+	// samples per bucket of the finest waveform summary level (e.g. 256),
+	// every next level has 4 times more. 0 levels skips the summary
+	size_t waveformBucketSize;
+	size_t waveformLevelCount;
+	// time range to decode in seconds, for preview clips. Decoding starts
+	// at the keyframe before startTime and is trimmed to the exact sample.
+	// endTime 0 decodes to the end
+	double startTime, endTime;
+};
+// filled by openAudioStream
+struct audioStreamInfo
+{
+	size_t sampleRate;
+	// in seconds, 0 if unknown
+	double duration;
+};
+// custom input for loadAudioIO, like avio_alloc_context callbacks.
+// read returns bytes read, 0 or negative at end of input.
+// whence of seek is SEEK_SET, SEEK_CUR, SEEK_END or AVSEEK_SIZE (return the
+// input size, or negative if unknown), returns the new position
+typedef int (*ioReadCallback)(void *userdata, uint8_t *buf, int bufSize);
+typedef int64_t (*ioSeekCallback)(void *userdata, int64_t offset, int whence);
+// incremental decoder, stereo 16-bit output like loadAudioFile
+struct audioStream;
+// loadAudioFile running on a background thread
+struct audioJob;
+// one recording, see openEncoderSession
+struct encoderSession;
+
+// what supply does when every queued frame is still being encoded
+enum encoderBackpressure
+{
+	// wait for the encoder
+	ENCODER_BLOCK = 0,
+	// skip the frame, leaving a gap in the timeline
+	ENCODER_DROP = 1
+};
+
+enum encoderStage
+{
+	// supply copying the frame into the queue
+	ENCODER_STAGE_COPY = 0,
+	// RGBA to encoder pixel format
+	ENCODER_STAGE_CONVERT,
+	// video encoder, per frame
+	ENCODER_STAGE_ENCODE,
+	// writing a packet of either track, includes disk I/O
+	ENCODER_STAGE_MUX,
+	ENCODER_STAGE_COUNT
+};
+
+// bucket 0 counts durations under 0.125 ms, each next one doubles the
+// limit and the last one counts everything longer
+const size_t ENCODER_HISTOGRAM_SIZE = 16;
+
+struct encoderStageStats
+{
+	uint64_t count;
+	// in seconds
+	double totalTime, maxTime;
+	uint64_t histogram[ENCODER_HISTOGRAM_SIZE];
+};
+
+struct encoderStats
+{
+	encoderStageStats stages[ENCODER_STAGE_COUNT];
+	// slots waiting for supply, conversion and encoding
+	size_t queueSize, idle, converting, encoding;
+	// video frames encoded, duplicates included
+	uint64_t encodedFrames;
+	// packet bytes of both tracks
+	uint64_t encodedBytes;
+	// encodedBytes over the muxed duration, in bits per second
+	double bitRate;
+	size_t dropped, duplicated;
+};
+
+// how supplied frames get their timestamps
+enum encoderTiming
+{
+	// every frame lasts 1/framerate, regardless of when it's supplied
+	ENCODER_TIMING_FRAME = 0,
+	// frames are placed on the 1/framerate grid by their time, repeating
+	// the previous frame over gaps and dropping frames that come too early
+	ENCODER_TIMING_CFR = 1,
+	// frames keep their time (in milliseconds), framerate is only a hint
+	ENCODER_TIMING_VFR = 2
+};
+
+// zero-initialized is the encoder defaults, see startSessionEx
+struct encoderOptions
+{
+	// e.g. "libx264", null picks the same one as startSession
+	const char *encoder;
+	// e.g. "veryfast", ignored by encoders without presets
+	const char *preset;
+	// constant quality, 0 leaves it to the encoder (or bitRate)
+	double crf;
+	// bits per second, 0 is encoder default
+	int64_t bitRate;
+	// e.g. "yuv420p", null picks one for the encoder
+	const char *pixelFormat;
+	// keyframe interval in frames, 0 is encoder default
+	int gopSize;
+	// 0 is auto
+	int threadCount;
+	// null-terminated list of key, value pairs set with av_opt_set
+	const char *const *extraOptions;
+	// crf=0 or lossless=1 depending on the encoder, overrides crf
+	bool lossless;
+	// adds an audio track like startSessionWithAudio, 0 is video only
+	int sampleRate;
+	// encoderTiming
+	int timing;
+	// RGBA conversion is split in this many horizontal bands converted in
+	// parallel, 0 picks from the frame size and core count
+	int conversionThreads;
 };
 
 bool isSupported();
+// applies to sessions started afterwards. queueSize frames are copied and
+// encoded on background threads, default 4 and ENCODER_BLOCK
+bool setEncoderPipeline(size_t queueSize, int backpressure);
 bool startSession(const char *output, int width, int height, int framerate);
+// also adds an audio track (FLAC, AAC or PCM, whichever is available)
+bool startSessionWithAudio(const char *output, int width, int height, int framerate, int sampleRate);
+// startSession and startSessionWithAudio are lossless with preset "slow"
+bool startSessionEx(const char *output, int width, int height, int framerate, const encoderOptions &options);
+// copies the frame and returns, false once encoding failed.
+// The frame time is now, for ENCODER_TIMING_CFR and ENCODER_TIMING_VFR
 bool supply(const void *videoData);
+// time in seconds from any clock (e.g. love.timer.getTime), only the
+// difference to the first frame matters
+bool supplyTimed(const void *videoData, double time);
+// rows stride bytes apart (0 is width * 4), bottom-up if flip is set, e.g.
+// framebuffer readback. Converted as is, without repacking
+bool supplyStrided(const void *videoData, int stride, bool flip);
+bool supplyStridedTimed(const void *videoData, double time, int stride, bool flip);
+// frames dropped by the timeline or a full queue and repeated to fill gaps
+void getEncoderFrameCounts(size_t &dropped, size_t &duplicated);
+// false without a session
+bool getEncoderStats(encoderStats &stats);
+// Sessions by handle, each with its own contexts and threads, so several
+// can record at once. The functions above drive one global session.
+// Different sessions may be used from different threads at the same time
+encoderSession *openEncoderSession(const char *output, int width, int height, int framerate, const encoderOptions &options);
+bool supplyEncoderSession(encoderSession *session, const void *videoData);
+bool supplyEncoderSessionTimed(encoderSession *session, const void *videoData, double time);
+bool supplyEncoderSessionStrided(encoderSession *session, const void *videoData, int stride, bool flip);
+bool supplyEncoderSessionStridedTimed(encoderSession *session, const void *videoData, double time, int stride, bool flip);
+bool supplyEncoderSessionAudio(encoderSession *session, const short *samples, size_t sampleCount);
+void getEncoderSessionFrameCounts(encoderSession *session, size_t &dropped, size_t &duplicated);
+void getEncoderSessionStats(encoderSession *session, encoderStats &stats);
+// finishes the file and frees the session
+void closeEncoderSession(encoderSession *session);
+// sampleCount frames of interleaved stereo 16-bit samples at the session
+// sample rate, e.g. from audiomix::getSamplePointer. Thread-safe with supply
+bool supplyAudio(const short *samples, size_t sampleCount);
+// encodes the queued frames and finishes the file
 void endSession();
+// threadCount 0 is auto, 1 is single-threaded (default). loadAudioFiles
+// workers each get threadCount threads
+// threadType is FF_THREAD_FRAME and/or FF_THREAD_SLICE
+bool setDecoderThreading(int threadCount, int threadType);
+void applyDecoderThreading(AVCodecContext *ctx);
 bool loadAudioFile(const char *input, songInformation &info);
+bool loadAudioFileEx(const char *input, songInformation &info, const decodeOptions &options);
+// decode from an encoded file already in memory, data must stay valid
+// until it returns
+bool loadAudioMemory(const void *data, size_t size, songInformation &info, const decodeOptions &options);
+// decode from callbacks, seek may be null for non-seekable input
+bool loadAudioIO(ioReadCallback read, ioSeekCallback seek, void *userdata, songInformation &info, const decodeOptions &options);
+// metadata, sample rate and cover art only, samples is null, loudness is 0
+// and sampleCount is estimated from the duration. Much faster than loadAudioFile
+bool probeAudioFile(const char *input, songInformation &info, const decodeOptions &options);
+// decode many files at once, errors receives 0 or AVERROR code per file
+// threadCount 0 uses all cores, memoryLimit 0 is unlimited
+void loadAudioFiles(const char *const *inputs, size_t count, songInformation *infos, int *errors, int threadCount, size_t memoryLimit);
+// returns immediately, the job must be freed with freeAudioJob
+audioJob *loadAudioFileAsync(const char *input);
+// true once the job finished, succeeded or not
+bool pollAudioJob(audioJob *job);
+// negative timeout waits forever, returns pollAudioJob
+bool waitAudioJob(audioJob *job, double timeout);
+// aborts decoding at the next packet, the job finishes with AVERROR_EXIT
+void cancelAudioJob(audioJob *job);
+// 0 to 1
+double getAudioJobProgress(audioJob *job);
+// 0 moves the decoded song to info (only once), AVERROR(EAGAIN) if still running
+int getAudioJobResult(audioJob *job, songInformation &info);
+// cancels the job if needed, never blocks
+void freeAudioJob(audioJob *job);
+audioStream *openAudioStream(const char *input, audioStreamInfo &info);
+// returns amount of samples written to dest, less than sampleCount at end of stream
+size_t readAudioStream(audioStream *stream, short *dest, size_t sampleCount);
+// sample accurate
+bool seekAudioStream(audioStream *stream, double time);
+void closeAudioStream(audioStream *stream);
 libavFunctions *getFunctionPointer();
 
 const std::map<std::string, void*> &getFunctions();
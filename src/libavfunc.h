@@ -64,6 +64,7 @@ LOAD_AVFUNC(lavu, dictCount, av_dict_count);
 LOAD_AVFUNC(lavu, dictGet, av_dict_get);
 LOAD_AVFUNC(lavu, strdup, av_strdup);
 LOAD_AVFUNC(lavu, malloc, av_mallocz);
+LOAD_AVFUNC(lavu, realloc, av_realloc);
 LOAD_AVFUNC(lavu, free, av_free);
 LOAD_AVFUNC(lavu, strerror, av_strerror);
 LOAD_AVFUNC(lavu, logSetLevel, av_log_set_level);
@@ -74,6 +75,8 @@ LOAD_AVFUNC(lavu, channelLayoutFromMask, av_channel_layout_from_mask);
 LOAD_AVFUNC(lavu, getDefaultChannelLayout, av_get_default_channel_layout);
 #endif
 LOAD_AVFUNC(lavu, imageAlloc, av_image_alloc);
+LOAD_AVFUNC(lavu, getPixelFormat, av_get_pix_fmt);
+LOAD_AVFUNC(lavu, pixFmtDescGet, av_pix_fmt_desc_get);
 // sws
 LOAD_AVFUNC(sws, swsGetContext, sws_getContext);
 LOAD_AVFUNC(sws, swsScale, sws_scale);
@@ -87,5 +90,6 @@ LOAD_AVFUNC(swr, swrAllocSetOpts, swr_alloc_set_opts);
 LOAD_AVFUNC(swr, swrInit, swr_init);
 LOAD_AVFUNC(swr, swrConvertFrame, swr_convert_frame);
 LOAD_AVFUNC(swr, swrGetDelay, swr_get_delay);
+LOAD_AVFUNC(swr, swrGetOutSamples, swr_get_out_samples);
 LOAD_AVFUNC(swr, swrConvert, swr_convert);
 LOAD_AVFUNC(swr, swrFree, swr_free);
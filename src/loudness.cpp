@@ -0,0 +1,271 @@
+// EBU R128 loudness measurement
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+
+#include "loudness.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace ls2x
+{
+namespace loudness
+{
+
+const double PI = 3.14159265358979323846;
+// sub-blocks per short-term block, momentary blocks are 4
+const size_t SHORT_TERM_BLOCKS = 30;
+const size_t MOMENTARY_BLOCKS = 4;
+// true peak oversampling
+const size_t OVERSAMPLE = 4;
+const size_t TAPS_PER_PHASE = 12;
+const double ABSOLUTE_GATE = -70.0;
+
+static double energyToLoudness(double energy)
+{
+	return energy > 0 ? -0.691 + 10.0 * log10(energy) : -HUGE_VAL;
+}
+
+static double loudnessToEnergy(double lufs)
+{
+	return pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+meter::meter(size_t sampleRate, int channels)
+: channels(channels > 0 ? channels : 1)
+, filterState(this->channels * 4, 0.0)
+, channelWeight(this->channels, 1.0)
+, subBlockSize(std::max(sampleRate / 10, size_t(1)))
+, subBlockFill(0)
+, subBlockEnergy(0)
+, recentSubBlocks(SHORT_TERM_BLOCKS, 0.0)
+, subBlockCount(0)
+, interpolator(OVERSAMPLE * TAPS_PER_PHASE)
+, history(this->channels * TAPS_PER_PHASE * 2, 0.0)
+, historyPos(0)
+, pendingPeak(0)
+, peakGain(1)
+, peak(0)
+{
+	double rate = double(sampleRate > 0 ? sampleRate : 48000);
+
+	// K-weighting, BS.1770 coefficients recomputed for the sample rate
+	{
+		double f0 = 1681.974450955533, gain = 3.999843853973347, q = 0.7071752369554196;
+		double k = tan(PI * f0 / rate);
+		double vh = pow(10.0, gain / 20.0);
+		double vb = pow(vh, 0.4996667741545416);
+		double a0 = 1.0 + k / q + k * k;
+		preFilter = {
+			(vh + vb * k / q + k * k) / a0,
+			2.0 * (k * k - vh) / a0,
+			(vh - vb * k / q + k * k) / a0,
+			2.0 * (k * k - 1.0) / a0,
+			(1.0 - k / q + k * k) / a0
+		};
+	}
+	{
+		double f0 = 38.13547087602444, q = 0.5003270373238773;
+		double k = tan(PI * f0 / rate);
+		double a0 = 1.0 + k / q + k * k;
+		rlbFilter = {1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0};
+	}
+
+	// surround channels are weighted, LFE is ignored
+	if (this->channels == 5)
+		channelWeight[3] = channelWeight[4] = 1.41;
+	else if (this->channels == 6)
+	{
+		channelWeight[3] = 0.0;
+		channelWeight[4] = channelWeight[5] = 1.41;
+	}
+
+	// windowed sinc interpolator, unity gain in every phase
+	size_t taps = interpolator.size();
+	double center = double(taps - 1) * 0.5;
+	double sum = 0;
+	for (size_t i = 0; i < taps; i++)
+	{
+		double t = (double(i) - center) / double(OVERSAMPLE);
+		double sinc = t == 0 ? 1.0 : sin(PI * t) / (PI * t);
+		double w = 0.42 - 0.5 * cos(2.0 * PI * double(i) / double(taps - 1)) + 0.08 * cos(4.0 * PI * double(i) / double(taps - 1));
+		interpolator[i] = sinc * w;
+		sum += interpolator[i];
+	}
+	for (size_t i = 0; i < taps; i++)
+		interpolator[i] *= double(OVERSAMPLE) / sum;
+
+	// largest possible gain of one phase, bounds inter-sample peaks
+	for (size_t p = 0; p < OVERSAMPLE; p++)
+	{
+		double g = 0;
+		for (size_t k = 0; k < TAPS_PER_PHASE; k++)
+			g += fabs(interpolator[p + k * OVERSAMPLE]);
+		peakGain = std::max(peakGain, g);
+	}
+}
+
+void meter::add(const short *samples, size_t frames)
+{
+	addSamples(samples, frames, 1.0 / 32768.0);
+}
+
+void meter::add(const float *samples, size_t frames)
+{
+	addSamples(samples, frames, 1.0);
+}
+
+void meter::add(const double *samples, size_t frames)
+{
+	addSamples(samples, frames, 1.0);
+}
+
+template<typename T> void meter::addSamples(const T *samples, size_t frames, double scale)
+{
+	for (size_t i = 0; i < frames; i++)
+	{
+		const T *frame = samples + i * channels;
+		bool interpolate = false;
+
+		for (int c = 0; c < channels; c++)
+		{
+			double x = double(frame[c]) * scale;
+
+			// history is stored twice so the window is always contiguous
+			double *h = &history[c * TAPS_PER_PHASE * 2];
+			h[historyPos] = h[historyPos + TAPS_PER_PHASE] = x;
+
+			double ax = fabs(x);
+			peak = ax > peak ? ax : peak;
+			interpolate = interpolate || ax * peakGain > peak;
+
+			// K-weighting, transposed direct form II
+			double *s = &filterState[c * 4];
+			double y = preFilter.b0 * x + s[0];
+			s[0] = preFilter.b1 * x - preFilter.a1 * y + s[1];
+			s[1] = preFilter.b2 * x - preFilter.a2 * y;
+			double z = rlbFilter.b0 * y + s[2];
+			s[2] = rlbFilter.b1 * y - rlbFilter.a1 * z + s[3];
+			s[3] = rlbFilter.b2 * y - rlbFilter.a2 * z;
+
+			subBlockEnergy += channelWeight[c] * z * z;
+		}
+
+		historyPos = (historyPos + 1) % TAPS_PER_PHASE;
+
+		// only interpolate while a sample that could exceed the peak is
+		// inside the window, quiet parts can't produce a higher peak
+		if (interpolate)
+			pendingPeak = TAPS_PER_PHASE;
+		if (pendingPeak > 0)
+		{
+			pendingPeak--;
+			for (int c = 0; c < channels; c++)
+			{
+				// oldest to newest
+				const double *window = &history[c * TAPS_PER_PHASE * 2 + historyPos];
+				for (size_t p = 0; p < OVERSAMPLE; p++)
+				{
+					double y = 0;
+					for (size_t k = 0; k < TAPS_PER_PHASE; k++)
+						y += interpolator[p + k * OVERSAMPLE] * window[TAPS_PER_PHASE - 1 - k];
+					y = fabs(y);
+					peak = y > peak ? y : peak;
+				}
+			}
+		}
+
+		if (++subBlockFill == subBlockSize)
+			endSubBlock();
+	}
+}
+
+void meter::endSubBlock()
+{
+	recentSubBlocks[subBlockCount % SHORT_TERM_BLOCKS] = subBlockEnergy / double(subBlockSize);
+	subBlockCount++;
+	subBlockEnergy = 0;
+	subBlockFill = 0;
+
+	// 400 ms and 3 s blocks, both advancing every 100 ms
+	size_t count[] = {MOMENTARY_BLOCKS, SHORT_TERM_BLOCKS};
+	std::vector<double> *blocks[] = {&momentary, &shortTerm};
+	for (int b = 0; b < 2; b++)
+	{
+		if (subBlockCount < count[b])
+			continue;
+
+		double sum = 0;
+		for (size_t i = 0; i < count[b]; i++)
+			sum += recentSubBlocks[(subBlockCount - 1 - i) % SHORT_TERM_BLOCKS];
+		blocks[b]->push_back(sum / double(count[b]));
+	}
+}
+
+// energy threshold of the relative gate, after the absolute gate
+static double relativeGate(const std::vector<double> &blocks, double gate)
+{
+	double absolute = loudnessToEnergy(ABSOLUTE_GATE), sum = 0;
+	size_t count = 0;
+
+	for (double e: blocks)
+	{
+		if (e > absolute)
+		{
+			sum += e;
+			count++;
+		}
+	}
+
+	if (count == 0)
+		return HUGE_VAL;
+	return std::max(sum / double(count) * pow(10.0, gate / 10.0), absolute);
+}
+
+double meter::getIntegratedLoudness() const
+{
+	double threshold = relativeGate(momentary, -10.0), sum = 0;
+	size_t count = 0;
+
+	for (double e: momentary)
+	{
+		if (e > threshold)
+		{
+			sum += e;
+			count++;
+		}
+	}
+
+	return count > 0 ? energyToLoudness(sum / double(count)) : -HUGE_VAL;
+}
+
+double meter::getLoudnessRange() const
+{
+	double threshold = relativeGate(shortTerm, -20.0);
+	std::vector<double> gated;
+
+	for (double e: shortTerm)
+	{
+		if (e > threshold)
+			gated.push_back(energyToLoudness(e));
+	}
+	if (gated.empty())
+		return 0;
+
+	// 10th to 95th percentile
+	std::sort(gated.begin(), gated.end());
+	double last = double(gated.size() - 1);
+	return gated[size_t(last * 0.95 + 0.5)] - gated[size_t(last * 0.10 + 0.5)];
+}
+
+double meter::getTruePeak() const
+{
+	return peak > 0 ? 20.0 * log10(peak) : -HUGE_VAL;
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,68 @@
+// EBU R128 loudness measurement
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+#ifndef _LS2X_LOUDNESS_
+#define _LS2X_LOUDNESS_
+
+#include <cstddef>
+#include <vector>
+
+namespace ls2x
+{
+namespace loudness
+{
+
+// Integrated loudness and loudness range per EBU R128 / ITU-R BS.1770-4,
+// true peak per BS.1770 Annex 2 (4x oversampling). Samples are fed as
+// they are decoded, nothing of the song is kept besides the block energies.
+class meter
+{
+public:
+	meter(size_t sampleRate, int channels);
+	// interleaved samples, short is scaled from 16-bit range
+	void add(const short *samples, size_t frames);
+	void add(const float *samples, size_t frames);
+	void add(const double *samples, size_t frames);
+	// in LUFS, -HUGE_VAL if silent or shorter than one block
+	double getIntegratedLoudness() const;
+	// in LU
+	double getLoudnessRange() const;
+	// in dBTP, -HUGE_VAL if silent
+	double getTruePeak() const;
+
+private:
+	template<typename T> void addSamples(const T *samples, size_t frames, double scale);
+	void endSubBlock();
+
+	struct biquad
+	{
+		double b0, b1, b2, a1, a2;
+	};
+
+	int channels;
+	biquad preFilter, rlbFilter;
+	// per channel: 2 states of each filter
+	std::vector<double> filterState;
+	std::vector<double> channelWeight;
+
+	// 100 ms sub-blocks, momentary blocks are 4 of them, short-term 30
+	size_t subBlockSize, subBlockFill;
+	double subBlockEnergy;
+	std::vector<double> recentSubBlocks;
+	size_t subBlockCount;
+	std::vector<double> momentary, shortTerm;
+
+	// true peak interpolation, per channel history of the last taps
+	std::vector<double> interpolator;
+	std::vector<double> history;
+	size_t historyPos, pendingPeak;
+	double peakGain, peak;
+};
+
+}
+}
+
+#endif
+#endif
@@ -41,6 +41,26 @@ if lib.features.fft then
 	fft.fftr2 = loadFunc("void(*)(const short *, kiss_fft_scalar *, size_t, bool)", lib.rawptr.fftr2)
 	fft.fftr3 = loadFunc("void(*)(const kiss_fft_scalar *, kiss_fft_scalar *, kiss_fft_scalar *, size_t)", lib.rawptr.fftr3)
 	fft.fftr4 = loadFunc("void(*)(const kiss_fft_scalar *, kiss_fft_scalar *, size_t, bool)", lib.rawptr.fftr4)
+
+	-- sliding DFT tracker
+	ffi.cdef("typedef struct sdftTracker sdftTracker;")
+	local newTracker = loadFunc("sdftTracker*(*)(size_t, size_t, const double *, size_t)", lib.rawptr.sdftNew)
+	local freeTracker = loadFunc("void(*)(sdftTracker *)", lib.rawptr.sdftFree)
+
+	fft.updateTracker = loadFunc("void(*)(sdftTracker *, const short *, size_t, int)", lib.rawptr.sdftUpdate)
+	fft.getTrackerMagnitudes = loadFunc("void(*)(const sdftTracker *, float *)", lib.rawptr.sdftGetMagnitudes)
+	fft.resetTracker = loadFunc("void(*)(sdftTracker *)", lib.rawptr.sdftReset)
+
+	-- frequencies is table of Hz, returned tracker is freed when garbage collected
+	function fft.newTracker(windowSize, sampleRate, frequencies)
+		local freq = ffi.new("double[?]", #frequencies, frequencies)
+		local tracker = newTracker(windowSize, sampleRate, freq, #frequencies)
+		if tracker == nil then
+			return nil
+		end
+
+		return ffi.gc(tracker, freeTracker)
+	end
 end
 
 -- libav
@@ -56,61 +76,612 @@ if lib.features.libav then
 			size_t valueSize;
 			char *value;
 		} songMetadata;
+		typedef struct waveformBucket
+		{
+			float min, max, rms;
+		} waveformBucket;
+		typedef struct waveformLevel
+		{
+			size_t samplesPerBucket;
+			size_t bucketCount;
+			waveformBucket *buckets;
+		} waveformLevel;
 		typedef struct songInformation
 		{
 			size_t sampleRate;
 			size_t sampleCount;
+			double integratedLoudness, loudnessRange, truePeak;
 			short *samples;
 			size_t metadataCount;
 			songMetadata *metadata;
 			size_t coverArtWidth, coverArtHeight;
 			char *coverArt;
+			size_t waveformLevelCount;
+			waveformLevel *waveform;
+			size_t channelCount;
+			int sampleFormat;
 		} songInformation;
+		typedef struct decodeOptions
+		{
+			size_t coverArtSize;
+			size_t coverArtMipCount;
+			size_t sampleRate;
+			size_t channelCount;
+			int sampleFormat;
+			size_t waveformBucketSize;
+			size_t waveformLevelCount;
+			double startTime, endTime;
+		} decodeOptions;
+		typedef struct audioStreamInfo
+		{
+			size_t sampleRate;
+			double duration;
+		} audioStreamInfo;
+		typedef struct audioStream audioStream;
+		typedef struct audioJob audioJob;
+		typedef struct encoderSession encoderSession;
+		typedef struct encoderOptions
+		{
+			const char *encoder;
+			const char *preset;
+			double crf;
+			int64_t bitRate;
+			const char *pixelFormat;
+			int gopSize;
+			int threadCount;
+			const char *const *extraOptions;
+			bool lossless;
+			int sampleRate;
+			int timing;
+			int conversionThreads;
+		} encoderOptions;
+		typedef struct encoderStageStats
+		{
+			uint64_t count;
+			double totalTime, maxTime;
+			uint64_t histogram[16];
+		} encoderStageStats;
+		typedef struct encoderStats
+		{
+			encoderStageStats stages[4];
+			size_t queueSize, idle, converting, encoding;
+			uint64_t encodedFrames;
+			uint64_t encodedBytes;
+			double bitRate;
+			size_t dropped, duplicated;
+		} encoderStats;
 	]]
 	local loadAudioFile = loadFunc("bool(*)(const char *input, songInformation *info)", lib.rawptr.loadAudioFile)
+	local loadAudioFileEx = loadFunc("bool(*)(const char *input, songInformation *info, const decodeOptions *options)", lib.rawptr.loadAudioFileEx)
+	local loadAudioMemory = loadFunc("bool(*)(const void *, size_t, songInformation *, const decodeOptions *)", lib.rawptr.loadAudioMemory)
+	local loadAudioIO = loadFunc("bool(*)(int(*)(void *, uint8_t *, int), int64_t(*)(void *, int64_t, int), void *, songInformation *, const decodeOptions *)", lib.rawptr.loadAudioIO)
+	local probeAudioFile = loadFunc("bool(*)(const char *input, songInformation *info, const decodeOptions *options)", lib.rawptr.probeAudioFile)
+	local loadAudioFiles = loadFunc("void(*)(const char *const *, size_t, songInformation *, int *, int, size_t)", lib.rawptr.loadAudioFiles)
+	local strerror = loadFunc("int(*)(int, char *, size_t)", lib.rawptr.av_strerror)
 	local encodingSupported = loadFunc("bool(*)()", lib.rawptr.encodingSupported)
 
 	if encodingSupported() then
 		libav.startEncodingSession = loadFunc("bool(*)(const char *, int, int, int)", lib.rawptr.startEncodingSession)
 		libav.supplyVideoEncoder = loadFunc("bool(*)(const void *)", lib.rawptr.supplyEncoder)
+		-- time in seconds, e.g. love.timer.getTime()
+		libav.supplyVideoEncoderTimed = loadFunc("bool(*)(const void *, double)", lib.rawptr.supplyEncoderTimed)
+		-- row stride in bytes (0 is width * 4) and bottom-up flag, e.g. framebuffer readback
+		libav.supplyVideoEncoderStrided = loadFunc("bool(*)(const void *, int, bool)", lib.rawptr.supplyEncoderStrided)
+		libav.supplyVideoEncoderStridedTimed = loadFunc("bool(*)(const void *, double, int, bool)", lib.rawptr.supplyEncoderStridedTimed)
+		local getEncoderFrameCounts = loadFunc("void(*)(size_t *, size_t *)", lib.rawptr.getEncoderFrameCounts)
+
+		-- returns dropped and duplicated frame count of the session
+		function libav.getEncoderFrameCounts()
+			local counts = ffi.new("size_t[2]")
+			getEncoderFrameCounts(counts, counts + 1)
+			return tonumber(counts[0]), tonumber(counts[1])
+		end
+		local getEncoderStats = loadFunc("bool(*)(encoderStats *)", lib.rawptr.getEncoderStats)
+
+		-- stats is an optional encoderStats[1] to reuse, returns it or nil
+		-- without a session. stages are copy, convert, encode and mux, times
+		-- in seconds, histogram bucket 0 is under 0.125 ms and each next one
+		-- doubles it
+		function libav.getEncoderStats(stats)
+			stats = stats or ffi.new("encoderStats[1]")
+			if getEncoderStats(stats) then
+				return stats
+			end
+			return nil
+		end
 		libav.endEncodingSession = loadFunc("void(*)()", lib.rawptr.endEncodingSession)
+		-- audio track, supplied with stereo 16-bit samples (e.g. audiomix output)
+		libav.startEncodingSessionWithAudio = loadFunc("bool(*)(const char *, int, int, int, int)", lib.rawptr.startEncodingSessionWithAudio)
+		libav.supplyAudioEncoder = loadFunc("bool(*)(const short *, size_t)", lib.rawptr.supplyAudioEncoder)
+		local startEncodingSessionEx = loadFunc("bool(*)(const char *, int, int, int, const encoderOptions *)", lib.rawptr.startEncodingSessionEx)
+		local encoderTimings = {frame = 0, cfr = 1, vfr = 2}
+
+		-- options table to encoderOptions, also returns the extra options array and
+		-- the Lua strings it points to, both must stay referenced until the C call returns
+		local function toEncoderOptions(options)
+			local opts = ffi.new("encoderOptions[1]")
+			local extra = {}
+			for k, v in pairs(options.extra or {}) do
+				extra[#extra + 1] = tostring(k)
+				extra[#extra + 1] = tostring(v)
+			end
+			local extraP = ffi.new("const char*[?]", #extra + 1, extra)
+
+			opts[0].encoder = options.encoder
+			opts[0].preset = options.preset
+			opts[0].crf = options.crf or 0
+			opts[0].bitRate = options.bitRate or 0
+			opts[0].pixelFormat = options.pixelFormat
+			opts[0].gopSize = options.gopSize or 0
+			opts[0].threadCount = options.threads or 0
+			opts[0].extraOptions = extraP
+			opts[0].lossless = not(not(options.lossless))
+			opts[0].sampleRate = options.sampleRate or 0
+			opts[0].timing = encoderTimings[options.timing or "frame"] or -1
+			opts[0].conversionThreads = options.conversionThreads or 0
+			return opts, extraP, extra
+		end
+
+		-- options: encoder (e.g. "libx264"), preset (e.g. "veryfast"), crf or bitRate,
+		-- pixelFormat (e.g. "yuv420p"), gopSize, threads, lossless, sampleRate for
+		-- an audio track, extra = {key = value} passed to av_opt_set and timing:
+		-- "frame" (default, every supplied frame lasts 1/framerate), "cfr" (placed
+		-- by time, repeated or dropped to keep the framerate) or "vfr" (keeps time).
+		-- conversionThreads splits RGBA conversion into parallel bands (0 or nil is auto)
+		function libav.startEncodingSessionEx(path, width, height, framerate, options)
+			local opts, extraP, extra = toEncoderOptions(options or {})
+			local result = startEncodingSessionEx(path, width, height, framerate, opts)
+			-- options are only read while the session starts
+			extraP, extra = nil, nil
+			return result
+		end
+
+		-- independent sessions, e.g. an archive and a stream copy at once
+		local openEncoderSession = loadFunc("encoderSession*(*)(const char *, int, int, int, const encoderOptions *)", lib.rawptr.openEncoderSession)
+		local closeEncoderSession = loadFunc("void(*)(encoderSession *)", lib.rawptr.closeEncoderSession)
+		local getEncoderSessionFrameCounts = loadFunc("void(*)(encoderSession *, size_t *, size_t *)", lib.rawptr.getEncoderSessionFrameCounts)
+		local getEncoderSessionStats = loadFunc("void(*)(encoderSession *, encoderStats *)", lib.rawptr.getEncoderSessionStats)
+		libav.supplyEncoderSession = loadFunc("bool(*)(encoderSession *, const void *)", lib.rawptr.supplyEncoderSession)
+		libav.supplyEncoderSessionTimed = loadFunc("bool(*)(encoderSession *, const void *, double)", lib.rawptr.supplyEncoderSessionTimed)
+		libav.supplyEncoderSessionStrided = loadFunc("bool(*)(encoderSession *, const void *, int, bool)", lib.rawptr.supplyEncoderSessionStrided)
+		libav.supplyEncoderSessionStridedTimed = loadFunc("bool(*)(encoderSession *, const void *, double, int, bool)", lib.rawptr.supplyEncoderSessionStridedTimed)
+		libav.supplyEncoderSessionAudio = loadFunc("bool(*)(encoderSession *, const short *, size_t)", lib.rawptr.supplyEncoderSessionAudio)
+
+		-- same options as startEncodingSessionEx, the file is finished when
+		-- the session is closed or garbage collected
+		function libav.openEncoderSession(path, width, height, framerate, options)
+			local opts, extraP, extra = toEncoderOptions(options or {})
+			local session = openEncoderSession(path, width, height, framerate, opts)
+			-- options are only read while the session opens
+			extraP, extra = nil, nil
+			if session == nil then
+				return nil
+			end
+
+			return ffi.gc(session, closeEncoderSession)
+		end
+
+		function libav.closeEncoderSession(session)
+			closeEncoderSession(ffi.gc(session, nil))
+		end
+
+		-- returns dropped and duplicated frame count of the session
+		function libav.getEncoderSessionFrameCounts(session)
+			local counts = ffi.new("size_t[2]")
+			getEncoderSessionFrameCounts(session, counts, counts + 1)
+			return tonumber(counts[0]), tonumber(counts[1])
+		end
+
+		-- same as libav.getEncoderStats
+		function libav.getEncoderSessionStats(session, stats)
+			stats = stats or ffi.new("encoderStats[1]")
+			getEncoderSessionStats(session, stats)
+			return stats
+		end
+
+		-- frames are encoded on background threads, queueSize frames can be
+		-- pending. mode "block" (default) waits for the encoder, "drop" skips the frame
+		local setEncoderPipeline = loadFunc("bool(*)(size_t, int)", lib.rawptr.setEncoderPipeline)
+		local backpressureModes = {block = 0, drop = 1}
+
+		function libav.setEncoderPipeline(queueSize, mode)
+			return setEncoderPipeline(queueSize or 4, backpressureModes[mode or "block"] or -1)
+		end
 	end
 	libav.free = loadFunc("void(*)(void *)", lib.rawptr.av_free)
 
-	function libav.loadAudioFile(path)
-		local sInfoP = ffi.new("songInformation[1]") -- FFI-managed object
-		local sInfo = sInfoP[0]
-		if loadAudioFile(path, sInfoP) then
-			local info = {
-				sampleRate = sInfo.sampleRate,
-				sampleCount = sInfo.sampleCount,
-				samples = sInfo.samples,
-				metadata = {},
+	-- decoder threading for audio and video decoding
+	-- count 0 = auto, 1 = off (default). mode "frame", "slice", or nil for both
+	local setDecoderThreading = loadFunc("bool(*)(int, int)", lib.rawptr.setDecoderThreading)
+	local threadModes = {frame = 1, slice = 2}
+
+	function libav.setDecoderThreading(count, mode)
+		return setDecoderThreading(count, mode and (threadModes[mode] or 0) or 3)
+	end
+
+	-- streaming decode, stereo 16-bit
+	local openAudioStream = loadFunc("audioStream*(*)(const char *, audioStreamInfo *)", lib.rawptr.openAudioStream)
+	local closeAudioStream = loadFunc("void(*)(audioStream *)", lib.rawptr.closeAudioStream)
+	libav.readAudioStream = loadFunc("size_t(*)(audioStream *, short *, size_t)", lib.rawptr.readAudioStream)
+	libav.seekAudioStream = loadFunc("bool(*)(audioStream *, double)", lib.rawptr.seekAudioStream)
+
+	-- returns stream (closed when garbage collected) and its information
+	function libav.openAudioStream(path)
+		local info = ffi.new("audioStreamInfo[1]")
+		local stream = openAudioStream(path, info)
+		if stream == nil then
+			return nil
+		end
+
+		return ffi.gc(stream, closeAudioStream), {
+			sampleRate = tonumber(info[0].sampleRate),
+			duration = info[0].duration
+		}
+	end
+
+	function libav.closeAudioStream(stream)
+		closeAudioStream(ffi.gc(stream, nil))
+	end
+
+	-- convert songInformation to table. Metadata shares one allocation with the
+	-- cover art, freed here when there's no cover art unless it's borrowed
+	local function toSongInfo(sInfo, borrowed)
+		local info = {
+			sampleRate = sInfo.sampleRate,
+			sampleCount = sInfo.sampleCount,
+			channels = tonumber(sInfo.channelCount),
+			-- LUFS, LU and dBTP
+			integratedLoudness = sInfo.integratedLoudness,
+			loudnessRange = sInfo.loudnessRange,
+			truePeak = sInfo.truePeak,
+			samples = sInfo.samples,
+			metadata = {},
+		}
+		if sInfo.coverArt ~= nil then
+			info.coverArt = {
+				width = sInfo.coverArtWidth,
+				height = sInfo.coverArtHeight,
+				data = sInfo.coverArt
 			}
-			if sInfo.coverArt ~= nil then
-				info.coverArt = {
-					width = sInfo.coverArtWidth,
-					height = sInfo.coverArtHeight,
-					data = sInfo.coverArt
+		end
+		if sInfo.waveform ~= nil then
+			-- free data with libav.free, levels are 0-based waveformBucket arrays
+			info.waveform = {data = sInfo.waveform}
+			for i = 1, tonumber(sInfo.waveformLevelCount) do
+				local level = sInfo.waveform[i-1]
+				info.waveform[i] = {
+					samplesPerBucket = tonumber(level.samplesPerBucket),
+					bucketCount = tonumber(level.bucketCount),
+					buckets = level.buckets
 				}
 			end
-			if sInfo.metadataCount > 0 then
-				for i = 1, tonumber(sInfo.metadataCount) do
-					local dict = sInfo.metadata[i-1]
-					local k = ffi.string(dict.key, dict.keySize)
-					local v = ffi.string(dict.value, dict.valueSize)
-					info.metadata[k] = v
-					libav.free(dict.key)
-					libav.free(dict.value)
-				end
-				libav.free(sInfo.metadata)
+		end
+		for i = 1, tonumber(sInfo.metadataCount) do
+			local dict = sInfo.metadata[i-1]
+			info.metadata[ffi.string(dict.key, dict.keySize)] = ffi.string(dict.value, dict.valueSize)
+		end
+		if not(borrowed) and sInfo.coverArt == nil and sInfo.metadata ~= nil then
+			libav.free(sInfo.metadata)
+		end
+
+		return info
+	end
+
+	-- frees a songInformation without wrapping it, cover art and metadata
+	-- share one allocation
+	local function freeSongInfo(sInfo)
+		libav.free(sInfo.coverArt ~= nil and sInfo.coverArt or sInfo.metadata)
+		libav.free(sInfo.samples)
+		libav.free(sInfo.waveform)
+	end
+
+	-- sample format name to decodeOptions sampleFormat and pointer type
+	local sampleFormats = {
+		s16 = {0, "short*"},
+		float = {1, "float*"},
+		fft = {2, ls2x.fft and "kiss_fft_scalar*"},
+	}
+
+	-- options table to decodeOptions, also returns the mip count and sample pointer type
+	local function toDecodeOptions(options)
+		local opts = ffi.new("decodeOptions[1]")
+		options = options or {}
+		local format = sampleFormats[options.format or "s16"]
+		assert(format and format[2], "invalid sample format")
+
+		opts[0].coverArtSize = options.coverArtSize or 0
+		opts[0].coverArtMipCount = options.coverArtMips or 0
+		opts[0].sampleRate = options.sampleRate or 0
+		opts[0].channelCount = options.channels or 0
+		opts[0].sampleFormat = format[1]
+		opts[0].waveformBucketSize = options.waveformBucketSize or 256
+		opts[0].waveformLevelCount = options.waveformLevels or 0
+		opts[0].startTime = options.startTime or 0
+		opts[0].endTime = options.endTime or 0
+		-- 0 and 1 both mean the base image only
+		return opts, math.max(options.coverArtMips or 1, 1), format[2]
+	end
+
+	-- coverArt.mips[1] is the base image, the rest follow it in the same buffer
+	local function addCoverArtMips(info, count)
+		local cover = info.coverArt
+		if cover == nil then
+			return info
+		end
+
+		local w, h = tonumber(cover.width), tonumber(cover.height)
+		local data = ffi.cast("char*", cover.data)
+		cover.mips = {}
+		for i = 1, count do
+			cover.mips[i] = {width = w, height = h, data = data}
+			if w == 1 and h == 1 then
+				break
 			end
+			data = data + w * h * 4
+			w, h = math.max(math.floor(w / 2), 1), math.max(math.floor(h / 2), 1)
+		end
+
+		return info
+	end
+
+	-- options: coverArtSize (longest side in pixels), coverArtMips (level count),
+	-- sampleRate, channels and format ("s16", "float", or "fft" for kiss_fft_scalar),
+	-- waveformLevels and waveformBucketSize (default 256) for waveform min/max/RMS summary,
+	-- startTime and endTime (seconds) to decode only part of the song, e.g. for previews
+	function libav.loadAudioFile(path, options)
+		local sInfoP = ffi.new("songInformation[1]") -- FFI-managed object
+		if options then
+			local opts, mips, sampleType = toDecodeOptions(options)
+			if loadAudioFileEx(path, sInfoP, opts) then
+				local info = addCoverArtMips(toSongInfo(sInfoP[0]), mips)
+				info.samples = ffi.cast(sampleType, info.samples)
+				return info
+			end
+		elseif loadAudioFile(path, sInfoP) then
+			return toSongInfo(sInfoP[0])
+		end
+
+		return nil
+	end
 
+	-- metadata and cover art only, for song listings. samples is nil and
+	-- sampleCount is estimated from the container duration
+	function libav.probeAudioFile(path, options)
+		local sInfoP = ffi.new("songInformation[1]")
+		local opts, mips = toDecodeOptions(options)
+		if probeAudioFile(path, sInfoP, opts) then
+			local info = addCoverArtMips(toSongInfo(sInfoP[0]), mips)
+			info.samples = nil
 			return info
 		else
 			return nil
 		end
 	end
+
+	-- decode an encoded file already in memory, data is a string or pointer
+	-- (size is required for pointers). Same options as loadAudioFile
+	function libav.loadAudioMemory(data, size, options)
+		local sInfoP = ffi.new("songInformation[1]")
+		local opts, mips, sampleType = toDecodeOptions(options)
+		if type(data) == "string" then
+			size = size or #data
+		end
+
+		if loadAudioMemory(data, size, sInfoP, opts) then
+			local info = addCoverArtMips(toSongInfo(sInfoP[0]), mips)
+			info.samples = ffi.cast(sampleType, info.samples)
+			return info
+		end
+
+		return nil
+	end
+
+	-- decode from Lua functions, e.g. a love.filesystem File or a network stream.
+	-- read(buf, size) fills uint8_t *buf and returns bytes read (0 at end).
+	-- seek(offset, whence) returns the new position, whence is 0 (set), 1 (current),
+	-- 2 (end) or 0x10000 (return size, negative if unknown). seek can be nil
+	-- for non-seekable input. Both are called before loadAudioIO returns
+	function libav.loadAudioIO(read, seek, options)
+		local sInfoP = ffi.new("songInformation[1]")
+		local opts, mips, sampleType = toDecodeOptions(options)
+		local readCb = ffi.cast("int(*)(void *, uint8_t *, int)", function(_, buf, size)
+			return read(buf, size) or 0
+		end)
+		local seekCb = seek and ffi.cast("int64_t(*)(void *, int64_t, int)", function(_, offset, whence)
+			return seek(offset, whence) or -1
+		end)
+
+		local result = loadAudioIO(readCb, seekCb, nil, sInfoP, opts)
+		readCb:free()
+		if seekCb then
+			seekCb:free()
+		end
+
+		if result then
+			local info = addCoverArtMips(toSongInfo(sInfoP[0]), mips)
+			info.samples = ffi.cast(sampleType, info.samples)
+			return info
+		end
+
+		return nil
+	end
+	-- callbacks can't be entered from JIT-compiled code
+	jit.off(libav.loadAudioIO)
+
+	function libav.errorString(code)
+		local buf = ffi.new("char[128]")
+		strerror(code, buf, 127)
+		return ffi.string(buf)
+	end
+
+	-- decode list of paths in parallel, returns info table (false on failure) and error code per path
+	-- threads 0 or nil uses all cores, memoryLimit in bytes (0 or nil is unlimited)
+	function libav.loadAudioFiles(paths, threads, memoryLimit)
+		local count = #paths
+		local pathsP = ffi.new("const char*[?]", count)
+		local sInfoP = ffi.new("songInformation[?]", count)
+		local errorsP = ffi.new("int[?]", count)
+		for i = 1, count do
+			pathsP[i-1] = paths[i]
+		end
+
+		loadAudioFiles(pathsP, count, sInfoP, errorsP, threads or 0, memoryLimit or 0)
+
+		local results, errors = {}, {}
+		for i = 1, count do
+			errors[i] = errorsP[i-1]
+			results[i] = errors[i] == 0 and toSongInfo(sInfoP[i-1])
+		end
+
+		return results, errors
+	end
+
+	-- background decode, job is freed (and cancelled) when garbage collected
+	local loadAudioFileAsync = loadFunc("audioJob*(*)(const char *)", lib.rawptr.loadAudioFileAsync)
+	local getAudioJobResult = loadFunc("int(*)(audioJob *, songInformation *)", lib.rawptr.getAudioJobResult)
+	local freeAudioJob = loadFunc("void(*)(audioJob *)", lib.rawptr.freeAudioJob)
+	local waitAudioJob = loadFunc("bool(*)(audioJob *, double)", lib.rawptr.waitAudioJob)
+	libav.pollAudioJob = loadFunc("bool(*)(audioJob *)", lib.rawptr.pollAudioJob)
+	libav.cancelAudioJob = loadFunc("void(*)(audioJob *)", lib.rawptr.cancelAudioJob)
+	libav.getAudioJobProgress = loadFunc("double(*)(audioJob *)", lib.rawptr.getAudioJobProgress)
+
+	function libav.loadAudioFileAsync(path)
+		local job = loadAudioFileAsync(path)
+		if job == nil then
+			return nil
+		end
+
+		return ffi.gc(job, freeAudioJob)
+	end
+
+	-- timeout in seconds, nil waits until finished
+	function libav.waitAudioJob(job, timeout)
+		return waitAudioJob(job, timeout or -1)
+	end
+
+	-- returns info table like loadAudioFile, or nil and error code
+	function libav.getAudioJobResult(job)
+		local sInfoP = ffi.new("songInformation[1]")
+		local ret = getAudioJobResult(job, sInfoP)
+		if ret == 0 then
+			return toSongInfo(sInfoP[0])
+		else
+			return nil, ret
+		end
+	end
+
+	function libav.freeAudioJob(job)
+		freeAudioJob(ffi.gc(job, nil))
+	end
+
+	-- decoded audio cache, directory must exist. nil directory disables it
+	local cacheConfigure = loadFunc("bool(*)(const char *, uint64_t)", lib.rawptr.audioCacheConfigure)
+	local cacheOpen = loadFunc("songInformation*(*)(const char *)", lib.rawptr.audioCacheOpen)
+	local cacheClose = loadFunc("void(*)(songInformation *)", lib.rawptr.audioCacheClose)
+	local cacheStore = loadFunc("bool(*)(const char *, const songInformation *)", lib.rawptr.audioCacheStore)
+	libav.clearAudioCache = loadFunc("void(*)()", lib.rawptr.audioCacheClear)
+
+	-- sizeLimit in bytes, 0 or nil is unlimited
+	function libav.setAudioCache(directory, sizeLimit)
+		return cacheConfigure(directory, sizeLimit or 0)
+	end
+
+	-- like loadAudioFile, but memory maps the cached decode when possible.
+	-- if info.cache is present, samples and cover art are read-only and owned
+	-- by it (don't free them), otherwise they're freed as usual
+	function libav.loadAudioFileCached(path)
+		local cached = cacheOpen(path)
+		if cached == nil then
+			local sInfoP = ffi.new("songInformation[1]")
+			if not(loadAudioFile(path, sInfoP)) then
+				return nil
+			end
+
+			if not(cacheStore(path, sInfoP)) then
+				return toSongInfo(sInfoP[0])
+			end
+
+			cached = cacheOpen(path)
+			if cached == nil then
+				return toSongInfo(sInfoP[0])
+			end
+
+			-- use the mapped copy, drop the decoded one
+			freeSongInfo(sInfoP[0])
+		end
+
+		local info = toSongInfo(cached, true)
+		info.cache = ffi.gc(cached, cacheClose)
+		return info
+	end
+end
+
+-- spectrogram
+if lib.features.spectrogram then
+	local spectrogram = {}
+	ls2x.spectrogram = spectrogram
+
+	ffi.cdef [[
+		typedef struct spectrogramInfo
+		{
+			size_t sampleRate;
+			size_t fftSize;
+			size_t hopSize;
+			size_t bandCount;
+			size_t bitDepth;
+			size_t frameCount;
+			float minFrequency, maxFrequency;
+			float minDecibel, maxDecibel;
+			const void *data;
+		} spectrogramInfo;
+	]]
+	local open = loadFunc("spectrogramInfo*(*)(const char *)", lib.rawptr.spectrogramOpen)
+	local close = loadFunc("void(*)(spectrogramInfo *)", lib.rawptr.spectrogramClose)
+	local getFrame = loadFunc("const void*(*)(const spectrogramInfo *, double)", lib.rawptr.spectrogramGetFrame)
+
+	spectrogram.write = loadFunc("bool(*)(const char *, const short *, size_t, size_t, size_t, size_t, size_t, int)", lib.rawptr.spectrogramWrite)
+
+	-- returns spectrogramInfo, closed when garbage collected
+	function spectrogram.open(path)
+		local info = open(path)
+		if info == nil then
+			return nil
+		end
+
+		return ffi.gc(info, close)
+	end
+
+	function spectrogram.close(info)
+		close(ffi.gc(info, nil))
+	end
+
+	-- returns uint8_t or uint16_t pointer to info.bandCount values
+	function spectrogram.getFrame(info, time)
+		local ptr = getFrame(info, time)
+		if info.bitDepth == 16 then
+			return ffi.cast("const uint16_t*", ptr)
+		else
+			return ffi.cast("const uint8_t*", ptr)
+		end
+	end
+
+	-- decode audio and write its spectrogram in one go
+	if ls2x.libav then
+		function spectrogram.writeFromAudioFile(input, output, fftSize, hopSize, bandCount, bitDepth)
+			local info = ls2x.libav.loadAudioFile(input)
+			if not(info) then
+				return false
+			end
+
+			local result = spectrogram.write(output, info.samples, info.sampleCount, info.sampleRate, fftSize or 2048, hopSize or 512, bandCount or 32, bitDepth or 8)
+			ls2x.libav.free(info.samples)
+			if info.coverArt then
+				ls2x.libav.free(info.coverArt.data)
+			end
+
+			return result
+		end
+	end
 end
 
 return ls2x
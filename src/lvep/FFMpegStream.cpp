@@ -13,6 +13,7 @@ FFMpegStream::FFMpegStream(love::filesystem::File *file, StreamType type)
 	, codecContext(nullptr)
 	, targetStream(-1)
 	, type(type)
+	, draining(false)
 	, file(file)
 	, f(ls2x::libav::getFunctionPointer())
 {
@@ -26,6 +27,7 @@ FFMpegStream::FFMpegStream(love::filesystem::FileData *fileData, StreamType type
 	, codecContext(nullptr)
 	, targetStream(-1)
 	, type(type)
+	, draining(false)
 	, fileData(fileData)
 	, f(ls2x::libav::getFunctionPointer())
 {
@@ -70,6 +72,7 @@ void FFMpegStream::initialize()
 		const AVCodec *codec = f->codecFindDecoder(param->codec_id);
 		codecContext = f->codecAllocContext(codec);
 		f->codecParametersToContext(codecContext, param);
+		ls2x::libav::applyDecoderThreading(codecContext);
 
 		if (f->codecOpen(codecContext, codec, nullptr) < 0)
 			throw love::Exception("Could not open target stream");
@@ -117,28 +120,32 @@ bool FFMpegStream::readFrame(AVFrame *frame)
 
 	while (true)
 	{
-		if (!readPacket())
+		// frame threading keeps several frames inside the decoder
+		int r = f->codecReceiveFrame(codecContext, frame);
+		if (r >= 0)
+			// got packet
+			return true;
+		else if (r == AVERROR_EOF || (r == AVERROR(EAGAIN) && draining))
 			return false;
-
-		int r = f->codecSendPacket(codecContext, packet);
-		if (r < 0)
+		else if (r != AVERROR(EAGAIN))
 		{
-			printError("f->codecSendPacket", r);
+			printError("f->codecReceiveFrame", r);
 			return false;
 		}
-		while (r >= 0)
+
+		if (readPacket())
+			r = f->codecSendPacket(codecContext, packet);
+		else
 		{
-			r = f->codecReceiveFrame(codecContext, frame);
-			if (r == AVERROR(EAGAIN) || r == AVERROR_EOF)
-				break;
-			else if (r < 0)
-			{
-				printError("f->codecReceiveFrame", r);
-				return false;
-			}
+			// end of file, drain the remaining frames
+			draining = true;
+			r = f->codecSendPacket(codecContext, nullptr);
+		}
 
-			// got packet
-			return true;
+		if (r < 0)
+		{
+			printError("f->codecSendPacket", r);
+			return false;
 		}
 	}
 }
@@ -159,5 +166,6 @@ bool FFMpegStream::seek(double target)
 	AVRational &base = formatContext->streams[targetStream]->time_base;
 	int64_t ts = target*base.den/double(base.num);
 	f->flushBuffers(codecContext);
+	draining = false;
 	return f->seekFrame(formatContext, targetStream, ts, AVSEEK_FLAG_BACKWARD) >= 0;
 }
@@ -49,6 +49,8 @@ private:
 
 	int targetStream;
 	StreamType type;
+	// null packet sent at end of file
+	bool draining;
 
 	love::StrongRef<love::filesystem::File> file;
 	love::StrongRef<love::filesystem::FileData> fileData;
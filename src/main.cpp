@@ -30,9 +30,12 @@ int luaopen_lvep(lua_State *L);
 #endif
 }
 
+#include "audiocache.h"
 #include "audiomix.h"
 #include "fft.h"
 #include "libav.h"
+#include "sdft.h"
+#include "spectrogram.h"
 
 #include <string>
 #include <map>
@@ -86,6 +89,12 @@ extern "C" int luaopen_ls2xlib(lua_State *L)
 		lua_pushboolean(L, 1);
 		lua_rawset(L, -3);
 		registerFunc(L, ptrTable, ls2x::fft::getFunctions());
+		registerFunc(L, ptrTable, ls2x::sdft::getFunctions());
+		// precomputed spectrogram
+		lua_pushstring(L, "spectrogram");
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		registerFunc(L, ptrTable, ls2x::spectrogram::getFunctions());
 #endif
 #ifdef LS2X_USE_LIBAV
 		// venc is bit more complex.
@@ -95,6 +104,7 @@ extern "C" int luaopen_ls2xlib(lua_State *L)
 			lua_pushboolean(L, 1);
 			lua_rawset(L, -3);
 			registerFunc(L, ptrTable, ls2x::libav::getFunctions());
+			registerFunc(L, ptrTable, ls2x::audiocache::getFunctions());
 #ifdef LS2X_EMBEDDED_IN_LOVE
 			// lvep
 			lua_getglobal(L, "package");
@@ -0,0 +1,32 @@
+// Read-only Memory Mapped File Wrapper
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifndef _LS2X_MAPFILE_
+#define _LS2X_MAPFILE_
+
+#include <cstddef>
+
+namespace ls2x
+{
+
+// read-only memory mapped file
+class mappedFile
+{
+public:
+	static mappedFile *newMappedFile(const char *path);
+	const void *getData() const;
+	size_t getSize() const;
+	~mappedFile();
+protected:
+	mappedFile(void *h, const void *d, size_t s);
+	void *handle;
+	const void *data;
+	size_t size;
+private:
+	mappedFile(const mappedFile&) = delete;
+};
+
+}
+
+#endif
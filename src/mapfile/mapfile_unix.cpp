@@ -0,0 +1,60 @@
+// Read-only Memory Mapped File Wrapper
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#include "mapfile.h"
+
+#ifndef _WIN32
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ls2x
+{
+
+mappedFile::mappedFile(void *h, const void *d, size_t s)
+: handle(h), data(d), size(s) {}
+
+// delete with C++ delete operator
+mappedFile *mappedFile::newMappedFile(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return nullptr;
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	// mapping stays valid after the descriptor is closed
+	void *ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return nullptr;
+
+	return new mappedFile(nullptr, ptr, size_t(st.st_size));
+}
+
+const void *mappedFile::getData() const
+{
+	return data;
+}
+
+size_t mappedFile::getSize() const
+{
+	return size;
+}
+
+mappedFile::~mappedFile()
+{
+	munmap(const_cast<void*>(data), size);
+}
+
+}
+
+#endif // !_WIN32
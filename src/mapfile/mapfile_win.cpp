@@ -0,0 +1,66 @@
+// Read-only Memory Mapped File Wrapper
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#include "mapfile.h"
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+namespace ls2x
+{
+
+mappedFile::mappedFile(void *h, const void *d, size_t s)
+: handle(h), data(d), size(s) {}
+
+// delete with C++ delete operator
+mappedFile *mappedFile::newMappedFile(const char *path)
+{
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return nullptr;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return nullptr;
+	}
+
+	// mapping object keeps the file alive
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (mapping == nullptr)
+		return nullptr;
+
+	const void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (ptr == nullptr)
+	{
+		CloseHandle(mapping);
+		return nullptr;
+	}
+
+	return new mappedFile(mapping, ptr, size_t(fileSize.QuadPart));
+}
+
+const void *mappedFile::getData() const
+{
+	return data;
+}
+
+size_t mappedFile::getSize() const
+{
+	return size;
+}
+
+mappedFile::~mappedFile()
+{
+	UnmapViewOfFile(data);
+	CloseHandle(HANDLE(handle));
+}
+
+}
+
+#endif // _WIN32
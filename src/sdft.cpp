@@ -0,0 +1,141 @@
+// Sliding DFT bin tracker
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_KISSFFT
+
+#include "sdft.h"
+
+#include <cmath>
+
+#include <algorithm>
+#include <new>
+
+namespace ls2x
+{
+namespace sdft
+{
+
+// Slight damping keeps the recursion stable against rounding error
+const double DAMPING = 0.999999;
+
+tracker::tracker(size_t windowSize, size_t sampleRate, const double *frequencies, size_t binCount)
+: windowSize(windowSize)
+, position(0)
+, history(windowSize, 0.0)
+, state(binCount)
+, rotate(binCount)
+, rotateOut(binCount)
+{
+	// X(n) = x(n) + r e^(jw) X(n-1) - r^N e^(jwN) x(n-N)
+	// exact for any frequency, not only multiples of sampleRate / N
+	for (size_t i = 0; i < binCount; i++)
+	{
+		double w = 2.0 * 3.14159265358979323846 * frequencies[i] / double(sampleRate);
+		rotate[i] = std::polar(DAMPING, w);
+		rotateOut[i] = std::polar(pow(DAMPING, double(windowSize)), w * double(windowSize));
+	}
+}
+
+inline void tracker::push(double sample)
+{
+	double out = history[position];
+	history[position] = sample;
+	if (++position == windowSize)
+		position = 0;
+
+	for (size_t i = 0; i < state.size(); i++)
+		state[i] = rotate[i] * state[i] + sample - rotateOut[i] * out;
+}
+
+void tracker::update(const short *samples, size_t sampleCount, int channelCount)
+{
+	switch (channelCount)
+	{
+		case 1:
+		{
+			for (size_t i = 0; i < sampleCount; i++)
+				push(double(samples[i]) / 32767.0);
+			break;
+		}
+		case 2:
+		{
+			for (size_t i = 0; i < sampleCount; i++)
+				push((double(samples[i * 2]) + double(samples[i * 2 + 1])) / 65534.0);
+			break;
+		}
+		default: return;
+	}
+}
+
+void tracker::getMagnitudes(float *out) const
+{
+	double scale = 2.0 / double(windowSize);
+	for (size_t i = 0; i < state.size(); i++)
+		out[i] = float(std::abs(state[i]) * scale);
+}
+
+void tracker::reset()
+{
+	position = 0;
+	std::fill(history.begin(), history.end(), 0.0);
+	std::fill(state.begin(), state.end(), std::complex<double>());
+}
+
+size_t tracker::getBinCount() const
+{
+	return state.size();
+}
+
+tracker *newTracker(size_t windowSize, size_t sampleRate, const double *frequencies, size_t binCount)
+{
+	if (windowSize == 0 || sampleRate == 0 || frequencies == nullptr || binCount == 0)
+		return nullptr;
+
+	// the buffers are std::vector, nothrow new alone doesn't cover them and
+	// nothing may be thrown back to LuaJIT
+	try
+	{
+		return new tracker(windowSize, sampleRate, frequencies, binCount);
+	}
+	catch (const std::bad_alloc &)
+	{
+		return nullptr;
+	}
+}
+
+void update(tracker *t, const short *samples, size_t sampleCount, int channelCount)
+{
+	t->update(samples, sampleCount, channelCount);
+}
+
+void getMagnitudes(const tracker *t, float *out)
+{
+	t->getMagnitudes(out);
+}
+
+void reset(tracker *t)
+{
+	t->reset();
+}
+
+void freeTracker(tracker *t)
+{
+	delete t;
+}
+
+const std::map<std::string, void*> &getFunctions()
+{
+	static std::map<std::string, void*> funcs = {
+		{"sdftNew", (void*) newTracker},
+		{"sdftUpdate", (void*) update},
+		{"sdftGetMagnitudes", (void*) getMagnitudes},
+		{"sdftReset", (void*) reset},
+		{"sdftFree", (void*) freeTracker},
+	};
+	return funcs;
+}
+
+}
+}
+#endif
@@ -0,0 +1,55 @@
+// Sliding DFT bin tracker
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_KISSFFT
+#ifndef _LS2X_SDFT_
+#define _LS2X_SDFT_
+
+#include <complex>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ls2x
+{
+namespace sdft
+{
+
+// Tracks the magnitude of few frequencies over the last windowSize samples.
+// Each sample costs O(bins) instead of a whole FFT per block.
+class tracker
+{
+public:
+	tracker(size_t windowSize, size_t sampleRate, const double *frequencies, size_t binCount);
+	// 16-bit interleaved input, stereo is downmixed
+	void update(const short *samples, size_t sampleCount, int channelCount);
+	// full scale sine at the tracked frequency gives 1
+	void getMagnitudes(float *out) const;
+	void reset();
+	size_t getBinCount() const;
+
+private:
+	size_t windowSize;
+	size_t position;
+	// ring buffer of the last windowSize samples
+	std::vector<double> history;
+	// per bin: state, rotation, and rotation of the leaving sample
+	std::vector<std::complex<double>> state, rotate, rotateOut;
+
+	void push(double sample);
+};
+
+tracker *newTracker(size_t windowSize, size_t sampleRate, const double *frequencies, size_t binCount);
+void update(tracker *t, const short *samples, size_t sampleCount, int channelCount);
+void getMagnitudes(const tracker *t, float *out);
+void reset(tracker *t);
+void freeTracker(tracker *t);
+
+const std::map<std::string, void*> &getFunctions();
+
+}
+}
+
+#endif
+#endif
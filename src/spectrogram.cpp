@@ -0,0 +1,315 @@
+// Precomputed band spectrogram
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_KISSFFT
+
+#include "spectrogram.h"
+#include "fft.h"
+#include "mapfile/mapfile.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace ls2x
+{
+namespace spectrogram
+{
+
+const float MIN_FREQUENCY = 20.0f;
+const float MIN_DECIBEL = -90.0f;
+const float MAX_DECIBEL = 0.0f;
+
+struct spectrogramFile
+{
+	// must be first, the pointer is given to the caller and cast back in close
+	spectrogramInfo info;
+	mappedFile *file;
+	// new[], 16-bit bands converted from little endian on big endian hosts
+	uint16_t *swapped;
+};
+// only guaranteed for standard-layout types
+static_assert(std::is_standard_layout<spectrogramFile>::value, "spectrogramFile must be standard-layout");
+
+const size_t HEADER_SIZE = 48;
+
+static bool isLittleEndian()
+{
+	const uint16_t probe = 1;
+	return *((const uint8_t *) &probe) == 1;
+}
+
+static void storeU32(uint8_t *&dest, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		*dest++ = uint8_t(value >> (i * 8));
+}
+
+static uint32_t loadU32(const uint8_t *&src)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 4; i++)
+		value |= uint32_t(*src++) << (i * 8);
+	return value;
+}
+
+static void storeFloat(uint8_t *&dest, float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(uint32_t));
+	storeU32(dest, bits);
+}
+
+static float loadFloat(const uint8_t *&src)
+{
+	uint32_t bits = loadU32(src);
+	float value;
+	memcpy(&value, &bits, sizeof(float));
+	return value;
+}
+
+static void encodeHeader(const fileHeader &header, uint8_t *dest)
+{
+	memcpy(dest, header.magic, 4);
+	dest += 4;
+	storeU32(dest, header.version);
+	storeU32(dest, header.sampleRate);
+	storeU32(dest, header.fftSize);
+	storeU32(dest, header.hopSize);
+	storeU32(dest, header.bandCount);
+	storeU32(dest, header.bitDepth);
+	storeU32(dest, header.frameCount);
+	storeFloat(dest, header.minFrequency);
+	storeFloat(dest, header.maxFrequency);
+	storeFloat(dest, header.minDecibel);
+	storeFloat(dest, header.maxDecibel);
+}
+
+static void decodeHeader(const uint8_t *src, fileHeader &header)
+{
+	memcpy(header.magic, src, 4);
+	src += 4;
+	header.version = loadU32(src);
+	header.sampleRate = loadU32(src);
+	header.fftSize = loadU32(src);
+	header.hopSize = loadU32(src);
+	header.bandCount = loadU32(src);
+	header.bitDepth = loadU32(src);
+	header.frameCount = loadU32(src);
+	header.minFrequency = loadFloat(src);
+	header.maxFrequency = loadFloat(src);
+	header.minDecibel = loadFloat(src);
+	header.maxDecibel = loadFloat(src);
+}
+
+bool write(const char *output, const short *samples, size_t sampleCount, size_t sampleRate, size_t fftSize, size_t hopSize, size_t bandCount, int bitDepth)
+{
+	if (samples == nullptr || sampleRate == 0 || hopSize == 0 || bandCount == 0)
+		return false;
+	// real FFT needs even size
+	if (fftSize < 2 || (fftSize & 1) || (bitDepth != 8 && bitDepth != 16))
+		return false;
+
+	fileHeader header = {};
+	memcpy(header.magic, "LS2S", 4);
+	header.version = VERSION;
+	header.sampleRate = uint32_t(sampleRate);
+	header.fftSize = uint32_t(fftSize);
+	header.hopSize = uint32_t(hopSize);
+	header.bandCount = uint32_t(bandCount);
+	header.bitDepth = uint32_t(bitDepth);
+	header.frameCount = uint32_t((sampleCount + hopSize - 1) / hopSize);
+	header.minFrequency = MIN_FREQUENCY;
+	header.maxFrequency = float(sampleRate) * 0.5f;
+	header.minDecibel = MIN_DECIBEL;
+	header.maxDecibel = MAX_DECIBEL;
+
+	if (header.maxFrequency <= header.minFrequency)
+		return false;
+
+	// bin range of each band, at least one bin wide
+	size_t halfSize = fftSize / 2;
+	std::vector<size_t> bandStart(bandCount), bandEnd(bandCount);
+	double ratio = pow(double(header.maxFrequency) / double(header.minFrequency), 1.0 / double(bandCount));
+	double binWidth = double(sampleRate) / double(fftSize);
+	for (size_t i = 0; i < bandCount; i++)
+	{
+		double low = header.minFrequency * pow(ratio, double(i));
+		double high = low * ratio;
+		size_t start = size_t(low / binWidth);
+		size_t end = size_t(ceil(high / binWidth));
+		if (start > halfSize) start = halfSize;
+		if (end > halfSize + 1) end = halfSize + 1;
+		if (end <= start) end = start + 1;
+		bandStart[i] = start;
+		bandEnd[i] = end;
+	}
+
+	// Hann window, full scale sine is 0 dB
+	std::vector<kiss_fft_scalar> window(fftSize);
+	for (size_t i = 0; i < fftSize; i++)
+		window[i] = kiss_fft_scalar((0.5 - 0.5 * cos(2.0 * 3.14159265358979323846 * double(i) / double(fftSize))) / 32767.0);
+	double normalize = 16.0 / (double(fftSize) * double(fftSize));
+
+	std::vector<kiss_fft_scalar> input(fftSize * 2), power(fftSize);
+	std::vector<uint8_t> frame(bandCount * (bitDepth / 8));
+
+	FILE *f = fopen(output, "wb");
+	if (f == nullptr)
+		return false;
+
+	uint8_t headerData[HEADER_SIZE];
+	encodeHeader(header, headerData);
+	bool ok = fwrite(headerData, HEADER_SIZE, 1, f) == 1;
+	for (size_t n = 0; ok && n < header.frameCount; n++)
+	{
+		// frame is centered at n * hopSize, zero padded outside the song
+		ptrdiff_t start = ptrdiff_t(n * hopSize) - ptrdiff_t(halfSize);
+		for (size_t i = 0; i < fftSize; i++)
+		{
+			ptrdiff_t pos = start + ptrdiff_t(i);
+			bool inside = pos >= 0 && size_t(pos) < sampleCount;
+			input[i * 2] = inside ? window[i] * kiss_fft_scalar(samples[pos * 2]) : 0;
+			input[i * 2 + 1] = inside ? window[i] * kiss_fft_scalar(samples[pos * 2 + 1]) : 0;
+		}
+
+		fft::fftr(input.data(), power.data(), fftSize, true);
+
+		for (size_t b = 0; b < bandCount; b++)
+		{
+			double sum = 0;
+			for (size_t k = bandStart[b]; k < bandEnd[b]; k++)
+				sum += double(power[k]);
+
+			double db = 10.0 * log10(sum * normalize / double(bandEnd[b] - bandStart[b]) + 1e-20);
+			double t = (db - MIN_DECIBEL) / (MAX_DECIBEL - MIN_DECIBEL);
+			t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+
+			if (bitDepth == 8)
+				frame[b] = uint8_t(t * 255.0 + 0.5);
+			else
+			{
+				uint16_t v = uint16_t(t * 65535.0 + 0.5);
+				frame[b * 2] = uint8_t(v);
+				frame[b * 2 + 1] = uint8_t(v >> 8);
+			}
+		}
+
+		ok = fwrite(frame.data(), frame.size(), 1, f) == 1;
+	}
+
+	ok = fclose(f) == 0 && ok;
+	if (!ok)
+		remove(output);
+
+	return ok;
+}
+
+spectrogramInfo *open(const char *path)
+{
+	mappedFile *file = mappedFile::newMappedFile(path);
+	if (file == nullptr)
+		return nullptr;
+
+	fileHeader header;
+	if (file->getSize() < HEADER_SIZE)
+	{
+		delete file;
+		return nullptr;
+	}
+	decodeHeader((const uint8_t *) file->getData(), header);
+
+	// validate
+	size_t dataSize = size_t(header.frameCount) * header.bandCount * (header.bitDepth / 8);
+	if (
+		memcmp(header.magic, "LS2S", 4) != 0 ||
+		header.version != VERSION ||
+		(header.bitDepth != 8 && header.bitDepth != 16) ||
+		header.hopSize == 0 ||
+		header.sampleRate == 0 ||
+		file->getSize() - HEADER_SIZE < dataSize
+	)
+	{
+		delete file;
+		return nullptr;
+	}
+
+	spectrogramFile *s = new (std::nothrow) spectrogramFile();
+	if (s == nullptr)
+	{
+		delete file;
+		return nullptr;
+	}
+
+	s->file = file;
+	s->info.sampleRate = header.sampleRate;
+	s->info.fftSize = header.fftSize;
+	s->info.hopSize = header.hopSize;
+	s->info.bandCount = header.bandCount;
+	s->info.bitDepth = header.bitDepth;
+	s->info.frameCount = header.frameCount;
+	s->info.minFrequency = header.minFrequency;
+	s->info.maxFrequency = header.maxFrequency;
+	s->info.minDecibel = header.minDecibel;
+	s->info.maxDecibel = header.maxDecibel;
+	s->info.data = ((const char *) file->getData()) + HEADER_SIZE;
+
+	// the mapping is used as is on little endian hosts
+	if (header.bitDepth == 16 && !isLittleEndian())
+	{
+		const uint8_t *src = (const uint8_t *) s->info.data;
+		s->swapped = new (std::nothrow) uint16_t[dataSize / 2];
+		if (s->swapped == nullptr)
+		{
+			close(&s->info);
+			return nullptr;
+		}
+
+		for (size_t i = 0; i < dataSize / 2; i++)
+			s->swapped[i] = uint16_t(src[i * 2] | (src[i * 2 + 1] << 8));
+		s->info.data = s->swapped;
+	}
+
+	return &s->info;
+}
+
+const void *getFrame(const spectrogramInfo *info, double time)
+{
+	if (info->frameCount == 0)
+		return nullptr;
+
+	double pos = floor(time * double(info->sampleRate) / double(info->hopSize) + 0.5);
+	size_t frame = pos <= 0.0 ? 0 : size_t(pos);
+	if (frame >= info->frameCount)
+		frame = info->frameCount - 1;
+
+	return ((const char *) info->data) + frame * info->bandCount * (info->bitDepth / 8);
+}
+
+void close(spectrogramInfo *info)
+{
+	spectrogramFile *s = (spectrogramFile *) info;
+	delete s->file;
+	delete[] s->swapped;
+	delete s;
+}
+
+const std::map<std::string, void*> &getFunctions()
+{
+	static std::map<std::string, void*> funcs = {
+		{"spectrogramWrite", (void*) write},
+		{"spectrogramOpen", (void*) open},
+		{"spectrogramGetFrame", (void*) getFrame},
+		{"spectrogramClose", (void*) close},
+	};
+	return funcs;
+}
+
+}
+}
+#endif
@@ -0,0 +1,67 @@
+// Precomputed band spectrogram
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_KISSFFT
+#ifndef _LS2X_SPECTROGRAM_
+#define _LS2X_SPECTROGRAM_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace ls2x
+{
+namespace spectrogram
+{
+
+// File layout, little endian regardless of the host:
+// fileHeader (48 bytes, fields in order without padding), then
+// frameCount * bandCount quantized bands (uint8_t or uint16_t).
+// Frame n is centered at sample n * hopSize. Bands are spaced logarithmically
+// from minFrequency to maxFrequency, value 0 is minDecibel and max is maxDecibel.
+const uint32_t VERSION = 1;
+
+struct fileHeader
+{
+	char magic[4]; // "LS2S"
+	uint32_t version;
+	uint32_t sampleRate;
+	uint32_t fftSize;
+	uint32_t hopSize;
+	uint32_t bandCount;
+	uint32_t bitDepth; // 8 or 16
+	uint32_t frameCount;
+	float minFrequency, maxFrequency;
+	float minDecibel, maxDecibel;
+};
+
+// returned by open, must be closed using close
+struct spectrogramInfo
+{
+	size_t sampleRate;
+	size_t fftSize;
+	size_t hopSize;
+	size_t bandCount;
+	size_t bitDepth;
+	size_t frameCount;
+	float minFrequency, maxFrequency;
+	float minDecibel, maxDecibel;
+	const void *data;
+};
+
+// samples is stereo 16-bit, as returned by libav loadAudioFile
+bool write(const char *output, const short *samples, size_t sampleCount, size_t sampleRate, size_t fftSize, size_t hopSize, size_t bandCount, int bitDepth);
+spectrogramInfo *open(const char *path);
+// pointer to bandCount values of the frame nearest to time (in seconds),
+// 16-bit values are in host byte order
+const void *getFrame(const spectrogramInfo *info, double time);
+void close(spectrogramInfo *info);
+
+const std::map<std::string, void*> &getFunctions();
+
+}
+}
+
+#endif
+#endif
@@ -0,0 +1,161 @@
+// Waveform min/max/RMS summary
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+
+#include "waveform.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace ls2x
+{
+namespace waveform
+{
+
+// each level merges this many buckets of the previous level
+const size_t LEVEL_FACTOR = 4;
+
+builder::builder(size_t samplesPerBucket, size_t levelCount)
+: samplesPerBucket(samplesPerBucket > 0 ? samplesPerBucket : 1)
+, levels(levelCount)
+, partial(levelCount)
+{
+	for (pending &p: partial)
+		p = {0, 0, 0, 0, 0};
+}
+
+void builder::add(const short *samples, size_t frames, int channels)
+{
+	addSamples(samples, frames, channels, 1.0f / 32768.0f);
+}
+
+void builder::add(const float *samples, size_t frames, int channels)
+{
+	addSamples(samples, frames, channels, 1.0f);
+}
+
+void builder::add(const double *samples, size_t frames, int channels)
+{
+	addSamples(samples, frames, channels, 1.0f);
+}
+
+template<typename T> void builder::addSamples(const T *samples, size_t frames, int channels, float scale)
+{
+	if (levels.empty() || channels <= 0)
+		return;
+
+	pending &p = partial[0];
+	float mix = scale / float(channels);
+
+	for (size_t i = 0; i < frames; i++)
+	{
+		float v = 0;
+		for (int c = 0; c < channels; c++)
+			v += float(samples[i * channels + c]);
+		v *= mix;
+
+		if (p.count == 0)
+			p.min = p.max = v;
+		else
+		{
+			p.min = v < p.min ? v : p.min;
+			p.max = v > p.max ? v : p.max;
+		}
+		p.sumSquares += double(v) * v;
+
+		if (++p.count == samplesPerBucket)
+		{
+			bucket b = {p.min, p.max, float(sqrt(p.sumSquares / double(p.count)))};
+			push(0, b, p.sumSquares, p.count);
+			p = {0, 0, 0, 0, 0};
+		}
+	}
+}
+
+// store finished bucket and merge it into the next level
+void builder::push(size_t index, const bucket &b, double sumSquares, size_t count)
+{
+	levels[index].push_back(b);
+	if (index + 1 >= levels.size())
+		return;
+
+	pending &p = partial[index + 1];
+	if (p.count == 0)
+	{
+		p.min = b.min;
+		p.max = b.max;
+	}
+	else
+	{
+		p.min = b.min < p.min ? b.min : p.min;
+		p.max = b.max > p.max ? b.max : p.max;
+	}
+	p.sumSquares += sumSquares;
+	p.sampleCount += count;
+
+	if (++p.count == LEVEL_FACTOR)
+	{
+		bucket merged = {p.min, p.max, float(sqrt(p.sumSquares / double(p.sampleCount)))};
+		double s = p.sumSquares;
+		size_t n = p.sampleCount;
+		p = {0, 0, 0, 0, 0};
+		push(index + 1, merged, s, n);
+	}
+}
+
+void builder::finish()
+{
+	// lower levels first, their last bucket feeds the next level
+	for (size_t i = 0; i < partial.size(); i++)
+	{
+		pending p = partial[i];
+		if (p.count == 0)
+			continue;
+
+		size_t n = i == 0 ? p.count : p.sampleCount;
+		partial[i] = {0, 0, 0, 0, 0};
+		bucket b = {p.min, p.max, float(sqrt(p.sumSquares / double(n)))};
+		push(i, b, p.sumSquares, n);
+	}
+}
+
+size_t builder::getLevelCount() const
+{
+	return levels.size();
+}
+
+size_t builder::getSize() const
+{
+	size_t size = sizeof(level) * levels.size();
+	for (const std::vector<bucket> &l: levels)
+		size += sizeof(bucket) * l.size();
+	return size;
+}
+
+level *builder::write(void *dest) const
+{
+	level *out = (level *) dest;
+	bucket *buckets = (bucket *) (out + levels.size());
+	size_t perBucket = samplesPerBucket;
+
+	for (size_t i = 0; i < levels.size(); i++)
+	{
+		out[i].samplesPerBucket = perBucket;
+		out[i].bucketCount = levels[i].size();
+		out[i].buckets = buckets;
+		if (!levels[i].empty())
+			memcpy(buckets, levels[i].data(), sizeof(bucket) * levels[i].size());
+
+		buckets += levels[i].size();
+		perBucket *= LEVEL_FACTOR;
+	}
+
+	return out;
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,71 @@
+// Waveform min/max/RMS summary
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#ifdef LS2X_USE_LIBAV
+#ifndef _LS2X_WAVEFORM_
+#define _LS2X_WAVEFORM_
+
+#include <cstddef>
+#include <vector>
+
+namespace ls2x
+{
+namespace waveform
+{
+
+// channels mixed to mono, -1 to 1
+struct bucket
+{
+	float min, max, rms;
+};
+
+struct level
+{
+	size_t samplesPerBucket;
+	size_t bucketCount;
+	bucket *buckets;
+};
+
+// Builds levels of buckets, each level 4 times coarser than the previous
+// one (e.g. 256, 1024, 4096 samples per bucket) from sample frames as they
+// are decoded.
+class builder
+{
+public:
+	builder(size_t samplesPerBucket, size_t levelCount);
+	// interleaved samples, short is scaled from 16-bit range
+	void add(const short *samples, size_t frames, int channels);
+	void add(const float *samples, size_t frames, int channels);
+	void add(const double *samples, size_t frames, int channels);
+	// closes the last partial bucket
+	void finish();
+	size_t getLevelCount() const;
+	// bytes needed by write
+	size_t getSize() const;
+	// level array followed by the buckets of every level, pointers refer
+	// inside dest, so the whole summary is released with one free
+	level *write(void *dest) const;
+
+private:
+	template<typename T> void addSamples(const T *samples, size_t frames, int channels, float scale);
+	void push(size_t index, const bucket &b, double sumSquares, size_t count);
+
+	struct pending
+	{
+		float min, max;
+		double sumSquares;
+		// samples for level 0, buckets of the previous level otherwise
+		size_t count, sampleCount;
+	};
+
+	size_t samplesPerBucket;
+	std::vector<std::vector<bucket>> levels;
+	std::vector<pending> partial;
+};
+
+}
+}
+
+#endif
+#endif
@@ -0,0 +1,230 @@
+// FFT correctness and throughput test
+// Part of Live Simulator: 2 Extensions
+// See copyright notice in LS2X main.cpp
+
+#include "fft.h"
+#include "sdft.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using ls2x::fft::kiss_fft_scalar_t;
+
+namespace
+{
+
+typedef std::vector<kiss_fft_scalar_t> scalarVector;
+
+// Accuracy relative to the peak of the reference spectrum
+const double tolerance = sizeof(kiss_fft_scalar_t) >= sizeof(double) ? 1e-9 : 1e-4;
+// Time spent measuring each entry point at each size
+const double benchSeconds = 0.02;
+
+const size_t testSizes[] = {
+	2, 3, 4, 6, 7, 10, 12, 16, 30, 64, 100, 128, 240, 256, 441, 480,
+	512, 735, 882, 1000, 1024, 1470, 2048, 4096
+};
+
+int failCount = 0;
+
+// squared magnitude of a naive DFT of a real signal
+std::vector<double> naiveDFT(const std::vector<double> &in)
+{
+	const double pi = 3.14159265358979323846;
+	size_t n = in.size();
+	std::vector<double> cosTable(n), sinTable(n), out(n);
+
+	for (size_t i = 0; i < n; i++)
+	{
+		cosTable[i] = cos(2.0 * pi * double(i) / double(n));
+		sinTable[i] = sin(2.0 * pi * double(i) / double(n));
+	}
+
+	for (size_t k = 0; k < n; k++)
+	{
+		long double re = 0, im = 0;
+		for (size_t t = 0; t < n; t++)
+		{
+			size_t j = (k * t) % n;
+			re += in[t] * cosTable[j];
+			im -= in[t] * sinTable[j];
+		}
+		out[k] = double(re * re + im * im);
+	}
+
+	return out;
+}
+
+void check(const char *name, size_t n, const scalarVector &got, const std::vector<double> &expected)
+{
+	double peak = 1, maxErr = 0;
+	for (double v: expected)
+		peak = v > peak ? v : peak;
+	for (size_t i = 0; i < n; i++)
+	{
+		double err = fabs(double(got[i]) - expected[i]);
+		maxErr = err > maxErr ? err : maxErr;
+	}
+
+	if (maxErr / peak > tolerance)
+	{
+		failCount++;
+		printf("FAIL %s n=%u: relative error %g\n", name, unsigned(n), maxErr / peak);
+	}
+}
+
+template<typename F> void bench(const char *name, size_t n, F func)
+{
+	typedef std::chrono::steady_clock clock;
+	size_t count = 0;
+	clock::time_point start = clock::now();
+	double elapsed = 0;
+
+	do
+	{
+		for (int i = 0; i < 16; i++)
+			func();
+		count += 16;
+		elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	}
+	while (elapsed < benchSeconds);
+
+	printf("%-6s %-7s n=%-5u %12.1f transforms/s\n", name, ls2x::fft::scalarType(), unsigned(n), double(count) / elapsed);
+}
+
+void testSize(size_t n, bool runBench)
+{
+	// deterministic noise plus two sines
+	std::vector<short> stereo(n * 2);
+	std::vector<double> left(n), right(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		double t = double(i) / double(n);
+		stereo[i * 2] = short(12000 * sin(2 * 3.14159265358979323846 * 3 * t) + (rand() % 8000) - 4000);
+		stereo[i * 2 + 1] = short(9000 * cos(2 * 3.14159265358979323846 * 7 * t) + (rand() % 8000) - 4000);
+		left[i] = stereo[i * 2] / 32767.0;
+		right[i] = stereo[i * 2 + 1] / 32767.0;
+	}
+
+	std::vector<double> refL = naiveDFT(left), refR = naiveDFT(right), refAvg(n);
+	for (size_t i = 0; i < n; i++)
+		refAvg[i] = (refL[i] + refR[i]) * 0.5;
+
+	scalarVector outL(n), outR(n), out(n);
+
+	// short input
+	ls2x::fft::fftr(stereo.data(), outL.data(), outR.data(), n);
+	check("fftr1 (left)", n, outL, refL);
+	check("fftr1 (right)", n, outR, refR);
+
+	ls2x::fft::fftr(stereo.data(), out.data(), n, true);
+	check("fftr2 (stereo)", n, out, refAvg);
+
+	std::vector<short> mono(n);
+	for (size_t i = 0; i < n; i++)
+		mono[i] = stereo[i * 2];
+	ls2x::fft::fftr(mono.data(), out.data(), n, false);
+	check("fftr2 (mono)", n, out, refL);
+
+	if (runBench)
+	{
+		bench("fftr1", n, [&]() {ls2x::fft::fftr(stereo.data(), outL.data(), outR.data(), n);});
+		bench("fftr2", n, [&]() {ls2x::fft::fftr(stereo.data(), out.data(), n, true);});
+	}
+
+	// kiss_fftr only supports even sizes
+	if (n % 2)
+		return;
+
+	scalarVector planar(n * 2), interleaved(n * 2);
+	for (size_t i = 0; i < n; i++)
+	{
+		planar[i] = interleaved[i * 2] = kiss_fft_scalar_t(left[i]);
+		planar[i + n] = interleaved[i * 2 + 1] = kiss_fft_scalar_t(right[i]);
+	}
+
+	ls2x::fft::fftr(planar.data(), outL.data(), outR.data(), n);
+	check("fftr3 (left)", n, outL, refL);
+	check("fftr3 (right)", n, outR, refR);
+
+	ls2x::fft::fftr(interleaved.data(), out.data(), n, true);
+	check("fftr4 (stereo)", n, out, refAvg);
+
+	ls2x::fft::fftr(planar.data(), out.data(), n, false);
+	check("fftr4 (mono)", n, out, refL);
+
+	if (runBench)
+	{
+		bench("fftr3", n, [&]() {ls2x::fft::fftr(planar.data(), outL.data(), outR.data(), n);});
+		bench("fftr4", n, [&]() {ls2x::fft::fftr(interleaved.data(), out.data(), n, true);});
+	}
+}
+
+// sliding DFT against naive DFT of the last window, at bin frequencies
+void testTracker(size_t n)
+{
+	const size_t sampleRate = 44100;
+	std::vector<short> mono(n * 5);
+	for (size_t i = 0; i < mono.size(); i++)
+		mono[i] = short(10000 * sin(2 * 3.14159265358979323846 * 5 * double(i) / double(n)) + (rand() % 8000) - 4000);
+
+	double frequencies[] = {0, 5 * double(sampleRate) / double(n), 11 * double(sampleRate) / double(n)};
+	size_t bins[] = {0, 5, 11};
+	ls2x::sdft::tracker *t = ls2x::sdft::newTracker(n, sampleRate, frequencies, 3);
+
+	// feed in uneven chunks
+	for (size_t i = 0; i < mono.size();)
+	{
+		size_t chunk = (rand() % 97) + 1;
+		chunk = chunk > mono.size() - i ? mono.size() - i : chunk;
+		ls2x::sdft::update(t, mono.data() + i, chunk, 1);
+		i += chunk;
+	}
+
+	std::vector<double> window(n);
+	for (size_t i = 0; i < n; i++)
+		window[i] = mono[mono.size() - n + i] / 32767.0;
+	std::vector<double> ref = naiveDFT(window);
+
+	float magnitude[3];
+	ls2x::sdft::getMagnitudes(t, magnitude);
+	ls2x::sdft::freeTracker(t);
+
+	for (int i = 0; i < 3; i++)
+	{
+		double expected = sqrt(ref[bins[i]]) * 2.0 / double(n);
+		// damping costs a fraction of a percent
+		if (fabs(magnitude[i] - expected) > 0.01 * (expected > 0.1 ? expected : 0.1))
+		{
+			failCount++;
+			printf("FAIL sdft n=%u bin %u: got %g expected %g\n", unsigned(n), unsigned(bins[i]), magnitude[i], expected);
+		}
+	}
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	bool runBench = !(argc > 1 && strcmp(argv[1], "--no-bench") == 0);
+	srand(1);
+
+	for (size_t n: testSizes)
+		testSize(n, runBench);
+	for (size_t n: testSizes)
+		if (n >= 16)
+			testTracker(n);
+
+	if (failCount > 0)
+	{
+		printf("%d check(s) failed\n", failCount);
+		return 1;
+	}
+
+	printf("All FFT checks passed (%s)\n", ls2x::fft::scalarType());
+	return 0;
+}